@@ -0,0 +1,335 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains the little-endian encoding of values and of
+    coordinate arrays.  Coordinates arrive from R as separate x and y
+    arrays of doubles; the kernels below flip y (R has its origin in the
+    lower left, EMF in the upper left), convert to float (EMF+) or to
+    rounded int (EMF) and, for EMF, find the bounding box, all in one
+    pass straight into the output buffer.  On x86 they use SSE2, or AVX2
+    when the CPU supports it (chosen at runtime); elsewhere (and on
+    big-endian hosts) plain C++ is used.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef EMF_COORDS__H
+#define EMF_COORDS__H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <math.h>
+
+#if !defined(WORDS_BIGENDIAN)  &&  defined(__GNUC__)  &&  defined(__SSE2__)
+#define EMF_HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__x86_64__)  ||  defined(__i386__)
+#define EMF_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+namespace EMF {
+    // store v at dst as little-endian (byte swapping only needed on
+    // big-endian hosts; otherwise a plain copy)
+    template<typename TType> inline void PutLE(char *dst, TType v) {
+#ifdef WORDS_BIGENDIAN
+        const char *ch = reinterpret_cast<const char*>(&v);
+        for (unsigned int i = 0;  i < sizeof(TType);  ++i) {
+            dst[i] = ch[sizeof(TType) - i - 1];
+        }
+#else
+        memcpy(dst, &v, sizeof(TType));
+#endif
+    }
+
+    // append n values to o as little-endian TOut (e.g., double -> float),
+    // growing o once rather than per value
+    template<typename TOut, typename TIn>
+    inline std::string& AppendLE(std::string &o, const TIn *v, size_t n) {
+        const size_t start = o.size();
+        o.resize(start + n*sizeof(TOut));
+        char *dst = &o[start];
+        for (size_t i = 0;  i < n;  ++i, dst += sizeof(TOut)) {
+            PutLE<TOut>(dst, v[i]);
+        }
+        return o;
+    }
+
+    // Coordinate kernels.  In all of them, y is replaced by height - y
+    // when height > 0 (the device always has a positive height, so 0
+    // means coordinates are already in EMF orientation).
+    class CCoordKernels {
+    public:
+        // n interleaved (x,y) doubles -> 2n floats
+        static void ToFloat(char *dst, const double *xy, size_t n) {
+            static TInterleavedFn fn = x_Pick(x_ToFloatScalar
+#ifdef EMF_HAVE_SSE2
+                                              , x_ToFloatSSE2
+#endif
+#ifdef EMF_HAVE_AVX2
+                                              , x_ToFloatAVX2
+#endif
+                );
+            fn(dst, xy, n);
+        }
+        // n points from separate x & y arrays -> 2n floats
+        static void ToFloat(char *dst, const double *x, const double *y,
+                            size_t n, double height) {
+            static TPlanarFloatFn fn = x_Pick(x_PlanarFloatScalar
+#ifdef EMF_HAVE_SSE2
+                                              , x_PlanarFloatSSE2
+#endif
+#ifdef EMF_HAVE_AVX2
+                                              , x_PlanarFloatAVX2
+#endif
+                );
+            fn(dst, x, y, n, height);
+        }
+        // n points from separate x & y arrays -> 2n ints, each rounded
+        // as floor(v + 0.5); also returns the bounds of the rounded
+        // points as left, top, right, bottom
+        static void ToInt(char *dst, const double *x, const double *y,
+                          size_t n, double height, int bounds[4]) {
+            static TPlanarIntFn fn = x_Pick(x_PlanarIntScalar
+#ifdef EMF_HAVE_SSE2
+                                            , x_PlanarIntSSE2
+#endif
+#ifdef EMF_HAVE_AVX2
+                                            , x_PlanarIntAVX2
+#endif
+                );
+            double b[4] = {HUGE_VAL, HUGE_VAL, -HUGE_VAL, -HUGE_VAL};
+            fn(dst, x, y, n, height, b);
+            for (int i = 0;  i < 4;  ++i) {
+                bounds[i] = (n == 0) ? 0 : (int) b[i];
+            }
+        }
+
+    private:
+        typedef void (*TInterleavedFn)(char*, const double*, size_t);
+        typedef void (*TPlanarFloatFn)(char*, const double*, const double*,
+                                       size_t, double);
+        typedef void (*TPlanarIntFn)(char*, const double*, const double*,
+                                     size_t, double, double*);
+
+        template<typename TFn> static TFn x_Pick(TFn scalar) {
+            return scalar;
+        }
+        template<typename TFn> static TFn x_Pick(TFn, TFn sse2) {
+            return sse2;
+        }
+        template<typename TFn> static TFn x_Pick(TFn, TFn sse2, TFn avx2) {
+#ifdef EMF_HAVE_AVX2
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return avx2;
+            }
+#endif
+            return sse2;
+        }
+
+        static double x_Y(double y, double height) {
+            return (height > 0) ? height - y : y;
+        }
+        static void x_Bound(double *b, double x, double y) {
+            if (x < b[0]) { b[0] = x; }
+            if (y < b[1]) { b[1] = y; }
+            if (x > b[2]) { b[2] = x; }
+            if (y > b[3]) { b[3] = y; }
+        }
+
+        // plain C++ versions (also used for remainders of SIMD versions)
+        static void x_ToFloatScalar(char *dst, const double *xy, size_t n) {
+            for (size_t i = 0;  i < 2*n;  ++i, dst += 4) {
+                PutLE<float>(dst, xy[i]);
+            }
+        }
+        static void x_PlanarFloatScalar(char *dst, const double *x,
+                                        const double *y, size_t n,
+                                        double height) {
+            for (size_t i = 0;  i < n;  ++i, dst += 8) {
+                PutLE<float>(dst, x[i]);
+                PutLE<float>(dst + 4, x_Y(y[i], height));
+            }
+        }
+        static void x_PlanarIntScalar(char *dst, const double *x,
+                                      const double *y, size_t n,
+                                      double height, double *b) {
+            for (size_t i = 0;  i < n;  ++i, dst += 8) {
+                double fx = floor(x[i] + 0.5);
+                double fy = floor(x_Y(y[i], height) + 0.5);
+                x_Bound(b, fx, fy);
+                PutLE<int>(dst, (int) fx);
+                PutLE<int>(dst + 4, (int) fy);
+            }
+        }
+
+#ifdef EMF_HAVE_SSE2
+        static void x_ToFloatSSE2(char *dst, const double *xy, size_t n) {
+            size_t i = 0;
+            for (;  i + 2 <= n;  i += 2, dst += 16) {
+                __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(xy + 2*i));
+                __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(xy + 2*i + 2));
+                _mm_storeu_ps(reinterpret_cast<float*>(dst),
+                              _mm_movelh_ps(lo, hi));
+            }
+            x_ToFloatScalar(dst, xy + 2*i, n - i);
+        }
+        static void x_PlanarFloatSSE2(char *dst, const double *x,
+                                      const double *y, size_t n,
+                                      double height) {
+            const bool flip = height > 0;
+            const __m128d h = _mm_set1_pd(height);
+            size_t i = 0;
+            for (;  i + 2 <= n;  i += 2, dst += 16) {
+                __m128d vy = _mm_loadu_pd(y + i);
+                if (flip) {
+                    vy = _mm_sub_pd(h, vy);
+                }
+                __m128 fx = _mm_cvtpd_ps(_mm_loadu_pd(x + i));
+                __m128 fy = _mm_cvtpd_ps(vy);
+                _mm_storeu_ps(reinterpret_cast<float*>(dst),
+                              _mm_unpacklo_ps(fx, fy));
+            }
+            x_PlanarFloatScalar(dst, x + i, y + i, n - i, height);
+        }
+        static __m128d x_FloorHalfSSE2(__m128d v) { //floor(v + 0.5)
+            const __m128d t = _mm_add_pd(v, _mm_set1_pd(0.5));
+            const __m128d tr = _mm_cvtepi32_pd(_mm_cvttpd_epi32(t));
+            //truncation rounded negative non-integers up
+            return _mm_sub_pd(tr, _mm_and_pd(_mm_cmpgt_pd(tr, t),
+                                             _mm_set1_pd(1)));
+        }
+        static void x_PlanarIntSSE2(char *dst, const double *x,
+                                    const double *y, size_t n,
+                                    double height, double *b) {
+            const bool flip = height > 0;
+            const __m128d h = _mm_set1_pd(height);
+            __m128d minX = _mm_set1_pd(b[0]), minY = _mm_set1_pd(b[1]);
+            __m128d maxX = _mm_set1_pd(b[2]), maxY = _mm_set1_pd(b[3]);
+            size_t i = 0;
+            for (;  i + 2 <= n;  i += 2, dst += 16) {
+                __m128d vy = _mm_loadu_pd(y + i);
+                if (flip) {
+                    vy = _mm_sub_pd(h, vy);
+                }
+                __m128d fx = x_FloorHalfSSE2(_mm_loadu_pd(x + i));
+                __m128d fy = x_FloorHalfSSE2(vy);
+                minX = _mm_min_pd(minX, fx);  maxX = _mm_max_pd(maxX, fx);
+                minY = _mm_min_pd(minY, fy);  maxY = _mm_max_pd(maxY, fy);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst),
+                                 _mm_unpacklo_epi32(_mm_cvttpd_epi32(fx),
+                                                    _mm_cvttpd_epi32(fy)));
+            }
+            double lanes[2];
+            _mm_storeu_pd(lanes, minX); b[0] = std::min(lanes[0], lanes[1]);
+            _mm_storeu_pd(lanes, minY); b[1] = std::min(lanes[0], lanes[1]);
+            _mm_storeu_pd(lanes, maxX); b[2] = std::max(lanes[0], lanes[1]);
+            _mm_storeu_pd(lanes, maxY); b[3] = std::max(lanes[0], lanes[1]);
+            x_PlanarIntScalar(dst, x + i, y + i, n - i, height, b);
+        }
+#endif
+
+#ifdef EMF_HAVE_AVX2
+        __attribute__((target("avx2")))
+        static void x_ToFloatAVX2(char *dst, const double *xy, size_t n) {
+            size_t i = 0;
+            for (;  i + 4 <= n;  i += 4, dst += 32) {
+                __m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(xy + 2*i));
+                __m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(xy + 2*i + 4));
+                _mm_storeu_ps(reinterpret_cast<float*>(dst), lo);
+                _mm_storeu_ps(reinterpret_cast<float*>(dst + 16), hi);
+            }
+            x_ToFloatScalar(dst, xy + 2*i, n - i);
+        }
+        __attribute__((target("avx2")))
+        static void x_PlanarFloatAVX2(char *dst, const double *x,
+                                      const double *y, size_t n,
+                                      double height) {
+            const bool flip = height > 0;
+            const __m256d h = _mm256_set1_pd(height);
+            size_t i = 0;
+            for (;  i + 4 <= n;  i += 4, dst += 32) {
+                __m256d vy = _mm256_loadu_pd(y + i);
+                if (flip) {
+                    vy = _mm256_sub_pd(h, vy);
+                }
+                __m128 fx = _mm256_cvtpd_ps(_mm256_loadu_pd(x + i));
+                __m128 fy = _mm256_cvtpd_ps(vy);
+                _mm_storeu_ps(reinterpret_cast<float*>(dst),
+                              _mm_unpacklo_ps(fx, fy));
+                _mm_storeu_ps(reinterpret_cast<float*>(dst + 16),
+                              _mm_unpackhi_ps(fx, fy));
+            }
+            x_PlanarFloatScalar(dst, x + i, y + i, n - i, height);
+        }
+        __attribute__((target("avx2")))
+        static void x_PlanarIntAVX2(char *dst, const double *x,
+                                    const double *y, size_t n,
+                                    double height, double *b) {
+            const bool flip = height > 0;
+            const __m256d h = _mm256_set1_pd(height);
+            const __m256d half = _mm256_set1_pd(0.5);
+            __m256d minX = _mm256_set1_pd(b[0]), minY = _mm256_set1_pd(b[1]);
+            __m256d maxX = _mm256_set1_pd(b[2]), maxY = _mm256_set1_pd(b[3]);
+            size_t i = 0;
+            for (;  i + 4 <= n;  i += 4, dst += 32) {
+                __m256d vy = _mm256_loadu_pd(y + i);
+                if (flip) {
+                    vy = _mm256_sub_pd(h, vy);
+                }
+                __m256d fx = _mm256_floor_pd(_mm256_add_pd
+                                             (_mm256_loadu_pd(x + i), half));
+                __m256d fy = _mm256_floor_pd(_mm256_add_pd(vy, half));
+                minX = _mm256_min_pd(minX, fx);
+                maxX = _mm256_max_pd(maxX, fx);
+                minY = _mm256_min_pd(minY, fy);
+                maxY = _mm256_max_pd(maxY, fy);
+                __m128i ix = _mm256_cvttpd_epi32(fx);
+                __m128i iy = _mm256_cvttpd_epi32(fy);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst),
+                                 _mm_unpacklo_epi32(ix, iy));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 16),
+                                 _mm_unpackhi_epi32(ix, iy));
+            }
+            double lanes[4];
+            _mm256_storeu_pd(lanes, minX); b[0] = x_Min4(lanes);
+            _mm256_storeu_pd(lanes, minY); b[1] = x_Min4(lanes);
+            _mm256_storeu_pd(lanes, maxX); b[2] = x_Max4(lanes);
+            _mm256_storeu_pd(lanes, maxY); b[3] = x_Max4(lanes);
+            x_PlanarIntScalar(dst, x + i, y + i, n - i, height, b);
+        }
+        static double x_Min4(const double *v) {
+            return std::min(std::min(v[0], v[1]), std::min(v[2], v[3]));
+        }
+        static double x_Max4(const double *v) {
+            return std::max(std::max(v[0], v[1]), std::max(v[2], v[3]));
+        }
+#endif
+    };
+} //end of EMF namespace
+
+#endif
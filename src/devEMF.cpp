@@ -49,27 +49,35 @@ using namespace std;
 class CDevEMF {
 public:
     CDevEMF(const char *defaultFontFamily, int coordDPI, bool customLty,
-            bool emfPlus, bool emfpFont, bool emfpRaster, bool emfpEmbed) :
+            bool emfPlus, bool emfpFont, bool emfpRaster, bool emfpEmbed,
+            int emfpRasterPNG, double rasterOversample,
+            int rasterTileSize, bool emfpRoundCoords) :
         m_debug(false) {
         m_DefaultFontFamily = defaultFontFamily;
         m_PageNum = 0;
         m_NumRecords = 0;
         m_CurrHadj = m_CurrPolyFill = -100;
         m_CurrClip[0] = m_CurrClip[1] = m_CurrClip[2] = m_CurrClip[3] = -1;
+        m_HaveLastPen = m_HaveLastBrush = false;
         m_CoordDPI = coordDPI;
         //feature options
         m_UseCustomLty = customLty;
         m_UseEMFPlus = emfPlus;
         if (m_debug) Rprintf("using emfplus: %d\n", emfPlus);
+        if (m_debug) m_ObjectTable.TrackRewrites();
         m_UseEMFPlusFont = emfpFont;
         m_UseEMFPlusRaster = emfpRaster;
         m_UseEMFPlusTextToPath = emfpEmbed;
+        m_RasterPNGLevel = emfpRasterPNG;
+        m_RasterOversample = rasterOversample;
+        m_RasterTileSize = rasterTileSize;
+        m_RoundCoords = emfpRoundCoords;
     }
 
     // Member-function R callbacks (see below class definition for
     // extern "C" versions
-    bool Open(const char* filename, int width, int height);
-    void Close(void);
+    bool Open(EMF::CSink *sink, int width, int height);
+    bool Close(void); //false if output could not be written
     void NewPage(const pGEcontext gc);
     void MetricInfo(int c, const pGEcontext gc, double* ascent,
                     double* descent, double* width);
@@ -122,18 +130,227 @@ private:
         for (int i = 0; i < n;  ++i, ++y) *y = m_Height - *y;
     }
 
-    unsigned char x_GetPen(const pGEcontext gc) {
-        return m_UseEMFPlus ?
+    // the last pen and solid brush are remembered along with the gc
+    // fields they were made from, so that a run of primitives in the
+    // same style skips building and looking up the objects
+    unsigned int x_GetPen(const pGEcontext gc) {
+        SPenKey key(gc);
+        if (m_HaveLastPen  &&  key == m_LastPenKey  &&
+            (m_UseEMFPlus ?
+             m_ObjectTable.Reuse(m_LastPen, m_LastPenStamp) :
+             m_ObjectTableEMF.ReusePen(m_LastPen, m_LastPenStamp, gc->ljoin,
+                                       gc->lmitre, m_File))) {
+            return m_LastPen;
+        }
+        unsigned int id = m_UseEMFPlus ?
             m_ObjectTable.GetPen(gc->col, gc->lwd*72./96., gc->lty, gc->lend,
                                  gc->ljoin, gc->lmitre, Inches2Dev(1)/72.,
                                  m_UseCustomLty, m_File) :
             m_ObjectTableEMF.GetPen(gc->col, gc->lwd*72./96., gc->lty, gc->lend,
                                     gc->ljoin, gc->lmitre, Inches2Dev(1)/72.,
                                     m_UseCustomLty, m_File);
+        m_HaveLastPen = true;
+        m_LastPenKey = key;
+        m_LastPen = id;
+        m_LastPenStamp = m_UseEMFPlus ? m_ObjectTable.GetStamp(id) :
+            m_ObjectTableEMF.GetStamp(id);
+        return id;
+    }
+    unsigned int x_GetSolidBrush(int col) {
+        if (m_HaveLastBrush  &&  col == m_LastBrushCol  &&
+            (m_UseEMFPlus ?
+             m_ObjectTable.Reuse(m_LastBrush, m_LastBrushStamp) :
+             m_ObjectTableEMF.ReuseBrush(m_LastBrush, m_LastBrushStamp,
+                                         m_File))) {
+            return m_LastBrush;
+        }
+        unsigned int id = m_UseEMFPlus ?
+            m_ObjectTable.GetBrush(col, m_File) :
+            m_ObjectTableEMF.GetBrush(col, m_File);
+        m_HaveLastBrush = true;
+        m_LastBrushCol = col;
+        m_LastBrush = id;
+        m_LastBrushStamp = m_UseEMFPlus ? m_ObjectTable.GetStamp(id) :
+            m_ObjectTableEMF.GetStamp(id);
+        return id;
+    }
+    // with emfPlusRoundCoords, EMF+ coordinates are rounded to the
+    // device grid (as EMF coordinates always are), so that most points
+    // can be stored as 16-bit integers; x & y are pointed at the rounded
+    // copies, which stay valid until the next call
+    void x_RoundCoords(int n, double *&x, double *&y) {
+        if (!m_UseEMFPlus  ||  !m_RoundCoords  ||  n <= 0) {
+            return;
+        }
+        m_RoundedX.resize(n);
+        m_RoundedY.resize(n);
+        for (int i = 0;  i < n;  ++i) {
+            m_RoundedX[i] = floor(x[i] + 0.5);
+            m_RoundedY[i] = floor(y[i] + 0.5);
+        }
+        x = &m_RoundedX[0];
+        y = &m_RoundedY[0];
+    }
+    // true if the fill is a pattern (gradient) rather than a color
+    static bool x_PatternFill(const pGEcontext gc) {
+#if R_GE_version >= 13
+        return R_TRANSPARENT(gc->fill)  &&  gc->patternFill != R_NilValue;
+#else
+        (void)gc;
+        return false;
+#endif
+    }
+    // Polylines are collected and written as one multi-figure EMF+
+    // path or EMF POLYPOLYLINE16 for each run drawn with the same pen
+    // (EMF+ only for opaque pens, as the figures of a path are not
+    // blended with each other where they cross)
+    void x_AddPolyline(int n, const double *x, const double *y,
+                       const pGEcontext gc) {
+        if (!m_LineCounts.empty()  &&
+            (!(SPenKey(gc) == SPenKey(&m_LinesGC))  ||
+             m_LineX.size() + n > kMaxPendingLinePts)) {
+            x_FlushLines();
+        }
+        if (n > kMaxPendingLinePts  ||
+            (m_UseEMFPlus  &&  !R_OPAQUE(gc->col))) {
+            x_WritePolyline(n, x, y, gc);
+            return;
+        }
+        if (m_LineCounts.empty()) {
+            m_LinesGC = *gc;
+        }
+        m_LineX.insert(m_LineX.end(), x, x + n);
+        m_LineY.insert(m_LineY.end(), y, y + n);
+        m_LineCounts.push_back(n);
+    }
+    void x_FlushLines(void) {
+        if (m_LineCounts.empty()) {
+            return;
+        }
+        if (m_LineCounts.size() == 1) {
+            x_WritePolyline(m_LineCounts[0], &m_LineX[0], &m_LineY[0],
+                            &m_LinesGC);
+        } else if (m_UseEMFPlus) {
+            int pathId = m_ObjectTable.GetPath
+                (new EMFPLUS::SPath(m_LineCounts.size(), &m_LineX[0],
+                                    &m_LineY[0], &m_LineCounts[0], m_Height,
+                                    false), m_File);
+            EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(&m_LinesGC));
+            drawPath.Write(m_File);
+        } else {
+            x_GetPen(&m_LinesGC);
+            EMF::SPolyPolyline polyline(m_LineCounts.size(), &m_LineCounts[0],
+                                        &m_LineX[0], &m_LineY[0], m_Height);
+            polyline.Write(m_File);
+        }
+        m_LineX.clear();
+        m_LineY.clear();
+        m_LineCounts.clear();
+    }
+    void x_WritePolyline(int n, const double *x, const double *y,
+                         const pGEcontext gc) {
+        //y is flipped (EMF has origin in upper left; R in lower left) as
+        //points are written
+        if (m_UseEMFPlus) {
+            EMFPLUS::SDrawLines lines(n, x, y, x_GetPen(gc), false, m_Height);
+            lines.Write(m_File);
+        } else {
+            x_GetPen(gc);
+            EMF::SPoly polyline(EMF::eEMR_POLYLINE, n, x, y, m_Height);
+            polyline.Write(m_File);
+        }
+    }
+    // called before anything else is drawn or the clip region changes
+    void x_FlushPending(void) {
+        x_FlushRects();
+        x_FlushLines();
+    }
+
+    // EMF+ rectangles are collected and written as one FillRects /
+    // DrawRects pair for each run in the same style
+    void x_AddRect(double x0, double y0, double x1, double y1,
+                   const pGEcontext gc) {
+        x_FlushLines();
+        if (R_TRANSPARENT(gc->fill)  &&  R_TRANSPARENT(gc->col)) {
+            return; //nothing to draw
+        }
+        EMFPLUS::SRectF r;
+        r.x = std::min(x0, x1);
+        r.y = m_Height - std::max(y0, y1);
+        r.w = fabs(x1 - x0);
+        r.h = fabs(y1 - y0);
+        if (!m_PendingRects.empty()) {
+            bool sameStyle = gc->fill == m_RectsGC.fill  &&
+                (R_TRANSPARENT(gc->col) ? R_TRANSPARENT(m_RectsGC.col) :
+                 SPenKey(gc) == SPenKey(&m_RectsGC));
+            //readers fill the run as one polypolygon (overlaps become
+            //holes), and all fills are drawn before all borders, so a
+            //filled rectangle must not touch the others (allowing for
+            //line width if bordered)
+            const double m = R_TRANSPARENT(gc->col) ? 0 :
+                gc->lwd*m_CoordDPI/96.;
+            bool overlaps = !R_TRANSPARENT(gc->fill)  &&
+                r.x - m <= m_RectsBox[2]  &&  r.x + r.w + m >= m_RectsBox[0]  &&
+                r.y - m <= m_RectsBox[3]  &&  r.y + r.h + m >= m_RectsBox[1];
+            if (!sameStyle  ||  overlaps  ||
+                m_PendingRects.size() >= kMaxPendingRects) {
+                x_FlushRects();
+            }
+        }
+        if (m_PendingRects.empty()) {
+            m_RectsGC = *gc;
+            m_RectsBox[0] = r.x;  m_RectsBox[1] = r.y;
+            m_RectsBox[2] = r.x + r.w;  m_RectsBox[3] = r.y + r.h;
+        } else {
+            m_RectsBox[0] = std::min(m_RectsBox[0], r.x);
+            m_RectsBox[1] = std::min(m_RectsBox[1], r.y);
+            m_RectsBox[2] = std::max(m_RectsBox[2], r.x + r.w);
+            m_RectsBox[3] = std::max(m_RectsBox[3], r.y + r.h);
+        }
+        m_PendingRects.push_back(r);
+        //translucent rectangles each need their own records, so that
+        //overlaps blend as they would when drawn one by one
+        if ((!R_OPAQUE(gc->fill)  &&  !R_TRANSPARENT(gc->fill))  ||
+            (!R_OPAQUE(gc->col)  &&  !R_TRANSPARENT(gc->col))) {
+            x_FlushRects();
+        }
+    }
+    void x_FlushRects(void) {
+        if (m_PendingRects.empty()) {
+            return;
+        }
+        if (!R_TRANSPARENT(m_RectsGC.fill)) {
+            EMFPLUS::SFillRects fill(m_PendingRects, m_RectsGC.fill);
+            fill.Write(m_File);
+        }
+        if (!R_TRANSPARENT(m_RectsGC.col)) {
+            EMFPLUS::SDrawRects draw(m_PendingRects, x_GetPen(&m_RectsGC));
+            draw.Write(m_File);
+        }
+        m_PendingRects.clear();
+    }
+    // true if an EMF+ polygon should be written with inline records
+    // rather than through its path object: solid (or no) fill, the path
+    // is not already in the table (where reusing it is cheapest), and
+    // the inline records are no larger than a new path object plus its
+    // FillPath / DrawPath records (inline, a filled and bordered
+    // polygon writes its points twice)
+    bool x_UseInlinePolygon(EMFPLUS::SPath &path, const pGEcontext gc) {
+        if (x_PatternFill(gc)  ||  m_ObjectTable.Contains(path)) {
+            return false;
+        }
+        const bool fill = !R_TRANSPARENT(gc->fill);
+        const bool draw = !R_TRANSPARENT(gc->col);
+        const size_t n = path.m_TotalPts;
+        const size_t pts = n*(path.m_FitsInt16 ? 4 : 8);
+        const size_t inlineSize = (fill ? 20 + pts : 0) + (draw ? 16 + pts : 0);
+        const size_t pathSize = 24 + pts + (n + 3)/4*4 +
+            (fill ? 16 : 0) + (draw ? 16 : 0);
+        return inlineSize <= pathSize;
     }
     int x_GetBrush(const pGEcontext gc) {
         if (!m_UseEMFPlus) {
-            return (m_ObjectTableEMF.GetBrush(gc->fill, m_File));
+            return x_GetSolidBrush(gc->fill);
         }
         bool hasFill = !R_TRANSPARENT(gc->fill);
 #if R_GE_version >= 13
@@ -143,7 +360,7 @@ private:
             return -1;
         }
         if (!R_TRANSPARENT(gc->fill)) {
-            return m_ObjectTable.GetBrush(new EMFPLUS::SBrush(gc->fill),m_File);
+            return x_GetSolidBrush(gc->fill);
         }
 #if R_GE_version >= 13
         switch (R_GE_patternType(gc->patternFill)) {
@@ -211,7 +428,7 @@ private:
             return i->second;
         }
     }
-    unsigned char x_GetFont(const pGEcontext gc, SSysFontInfo *info = NULL,
+    unsigned int x_GetFont(const pGEcontext gc, SSysFontInfo *info = NULL,
                             double rot = 0) {
         if (info == NULL) {
             info = x_GetFontInfo(gc);
@@ -252,6 +469,10 @@ private:
     bool m_UseEMFPlusFont;
     bool m_UseEMFPlusRaster;
     bool m_UseEMFPlusTextToPath;
+    int m_RasterPNGLevel;
+    double m_RasterOversample; //max image px per device px (0 = no limit)
+    int m_RasterTileSize; //side of raster tiles in px (0 = no tiling)
+    bool m_RoundCoords; //round EMF+ coordinates to the device grid
 
     //EMF states
     double m_CurrHadj;
@@ -260,8 +481,37 @@ private:
     double m_CurrClip[4];
 
     //EMF/EMF+ objects
+    struct SPenKey { //gc fields that determine a pen
+        int col, lty, lend, ljoin;
+        double lwd, lmitre;
+        SPenKey(void) {}
+        SPenKey(const pGEcontext gc) : col(gc->col), lty(gc->lty),
+                                       lend(gc->lend), ljoin(gc->ljoin),
+                                       lwd(gc->lwd), lmitre(gc->lmitre) {}
+        bool operator== (const SPenKey &k) const {
+            return col == k.col  &&  lty == k.lty  &&  lend == k.lend  &&
+                ljoin == k.ljoin  &&  lwd == k.lwd  &&  lmitre == k.lmitre;
+        }
+    };
+    bool m_HaveLastPen;
+    SPenKey m_LastPenKey;
+    unsigned int m_LastPen;
+    unsigned int m_LastPenStamp;
+    bool m_HaveLastBrush;
+    int m_LastBrushCol;
+    unsigned int m_LastBrush;
+    unsigned int m_LastBrushStamp;
     EMFPLUS::CObjectTable m_ObjectTable;
     EMF::CObjectTable m_ObjectTableEMF;
+    enum { kMaxPendingRects = 1024 };
+    std::vector<EMFPLUS::SRectF> m_PendingRects; //(all in style m_RectsGC)
+    R_GE_gcontext m_RectsGC;
+    double m_RectsBox[4]; //bounding box of the pending rectangles
+    enum { kMaxPendingLinePts = 3000 }; //(an EMF+ path fits one record)
+    std::vector<double> m_LineX, m_LineY; //(all in the pen of m_LinesGC)
+    std::vector<int> m_LineCounts;
+    R_GE_gcontext m_LinesGC;
+    std::vector<double> m_RoundedX, m_RoundedY; //see x_RoundCoords
 
     //system info for font metrics
     CFontInfoIndex m_FontInfoIndex;
@@ -288,8 +538,11 @@ extern "C" {
         static_cast<CDevEMF*>(dd->deviceSpecific)->Path(x,y, n,np, wnd, gc);
     }
     void EMFcb_Close(pDevDesc dd) {
-        static_cast<CDevEMF*>(dd->deviceSpecific)->Close();
+        bool ok = static_cast<CDevEMF*>(dd->deviceSpecific)->Close();
         delete static_cast<CDevEMF*>(dd->deviceSpecific);
+        if (!ok) {
+            Rf_warning("emf: error writing output (file is incomplete)");
+        }
     }
     void EMFcb_NewPage(const pGEcontext gc, pDevDesc dd) {
         static_cast<CDevEMF*>(dd->deviceSpecific)->NewPage(gc);
@@ -398,14 +651,14 @@ double CDevEMF::StrWidth(const char *str, const pGEcontext gc) {
 
 	/* Initialize the device */
 
-bool CDevEMF::Open(const char* filename, int width, int height)
+bool CDevEMF::Open(EMF::CSink *sink, int width, int height)
 {
     if (m_debug) Rprintf("open: %i, %i\n", width, height);
     m_Width = width;
     m_Height = height;
     
-    m_File.open(R_ExpandFileName(filename), ios_base::binary);
-    if (!m_File) {
+    m_File.open(sink);
+    if (!m_File.good()) {
 	return FALSE;
     }
 
@@ -508,6 +761,7 @@ bool CDevEMF::Open(const char* filename, int width, int height)
 }
 
 void CDevEMF::NewPage(const pGEcontext gc) {
+    x_FlushPending();
     if (++m_PageNum > 1) {
         Rf_warning("Multiple pages not available for EMF device");
     }
@@ -531,6 +785,7 @@ void CDevEMF::Clip(double x0, double x1, double y0, double y1)
          m_CurrClip[3] != -1)) {
         return; //skip if unchanged
     }
+    x_FlushPending();
     m_CurrClip[0] = x0;
     m_CurrClip[1] = y0;
     m_CurrClip[2] = x1;
@@ -552,9 +807,25 @@ void CDevEMF::Clip(double x0, double x1, double y0, double y1)
 }
 
 
-void CDevEMF::Close(void)
+bool CDevEMF::Close(void)
 {
     if (m_debug) Rprintf("close\n");
+    x_FlushPending();
+    if (m_debug  &&  m_UseEMFPlus) {
+        const char *names[] = {"", "brush", "pen", "path", "", "image",
+                               "font", "string format"};
+        for (int t = EMFPLUS::eTypeBrush;  t <= EMFPLUS::eTypeStringFormat;
+             ++t) {
+            const EMFPLUS::SObjectStats &stats =
+                m_ObjectTable.GetStats(EMFPLUS::EObjectType(t));
+            if (stats.m_Requests > 0) {
+                Rprintf("EMF+ %s objects: %lu requested, %lu written "
+                        "(%lu rewritten after eviction)\n", names[t],
+                        stats.m_Requests, stats.m_Written,
+                        stats.m_Rewritten);
+            }
+        }
+    }
 
     if (m_UseEMFPlus) {
         EMFPLUS::SEndOfFile empr;
@@ -572,22 +843,85 @@ void CDevEMF::Close(void)
 
     { //Edit header record to report number of records, handles & size
         unsigned int nBytes = m_File.tellp();
-        m_File.seekp(4*12);//offset of nBytes field of EMF header
         string data;
         data << EMF::TUInt4(nBytes)
              << EMF::TUInt4(m_File.nRecords)
             //not mentioned in spec, but seems to need one extra handle
              << EMF::TUInt4(m_ObjectTableEMF.GetSize()+1);
-        m_File.write(data.data(), 12);
+        m_File.Patch(4*12, data.data(), 12);//offset of nBytes field of header
         m_File.close();
     }
+    return m_File.good();
 }
 
 void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
                      double width, double height, double rot,
                      Rboolean interpolate) {
     if (m_debug) Rprintf("raster: %d,%d / %f,%f,%f,%f\n", w,h,x,y,width,height);
-    
+    x_FlushPending();
+
+    std::vector<unsigned int> cropped;
+    if (rot == 0  &&  width > 0  &&  height > 0  &&  m_CurrClip[0] != -1  &&
+        m_CurrClip[1] != -1  &&  m_CurrClip[2] != -1  &&
+        m_CurrClip[3] != -1) {
+        //only store pixels inside the clip region (plus a margin, so
+        //interpolation at the edges is unchanged); rows run top down
+        const double pw = width/w, ph = height/h;
+        const int margin = interpolate ? 1 : 0;
+        const double top = y + height;
+        int left = std::max<double>
+            (0, floor((std::min(m_CurrClip[0], m_CurrClip[2]) - x)/pw) - margin);
+        int right = std::min<double>
+            (w, ceil((std::max(m_CurrClip[0], m_CurrClip[2]) - x)/pw) + margin);
+        int upper = std::max<double>
+            (0, floor((top - std::max(m_CurrClip[1], m_CurrClip[3]))/ph) - margin);
+        int lower = std::min<double>
+            (h, ceil((top - std::min(m_CurrClip[1], m_CurrClip[3]))/ph) + margin);
+        if (left >= right  ||  upper >= lower) {
+            return; //entirely clipped
+        }
+        if (right - left < w  ||  lower - upper < h) {
+            EMF::SPixelRect(left, upper, right, lower).Copy(cropped, r, w);
+            r = &cropped[0];
+            x += left*pw;
+            y += (h - lower)*ph;
+            w = right - left;
+            h = lower - upper;
+            width = w*pw;
+            height = h*ph;
+        }
+    }
+
+    std::vector<unsigned int> scaled;
+    if (m_RasterOversample > 0) {
+        //don't store (many) more pixels than the output covers
+        int tw = std::max(1., std::min<double>
+                          (w, ceil(fabs(width)*m_RasterOversample)));
+        int th = std::max(1., std::min<double>
+                          (h, ceil(fabs(height)*m_RasterOversample)));
+        if (tw < w  ||  th < h) {
+            EMF::CRasterScaler::Downsample(scaled, r, w, h, tw, th,
+                                           interpolate);
+            r = &scaled[0];
+            w = tw;
+            h = th;
+        }
+    }
+
+    //blocks of pixels to draw (large images can skip transparent tiles)
+    std::vector<EMF::SPixelRect> blocks;
+    if (m_RasterTileSize > 0  &&
+        (w > m_RasterTileSize  ||  h > m_RasterTileSize)) {
+        blocks = EMF::VisibleTiles(r, w, h, m_RasterTileSize);
+        if (blocks.empty()) {
+            return; //entirely transparent
+        }
+    } else {
+        blocks.push_back(EMF::SPixelRect(0, 0, w, h));
+    }
+    const double pw = width/w, ph = height/h;
+    std::vector<unsigned int> tile;
+
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
     y -= height;
     /* Sigh.. as of 2016, LibreOffice support for EMF+ raster ops is broken/missing .*/
@@ -605,9 +939,22 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
              EMFPLUS::eInterpolationModeHighQualityBilinear:
              EMFPLUS::eInterpolationModeNearestNeighbor);
         m1.Write(m_File);
-        EMFPLUS::SDrawImage image(m_ObjectTable.GetImage(r,w,h,m_File), w,h,
-                                  x, y, width, height);
-        image.Write(m_File);
+        for (unsigned int i = 0;  i < blocks.size();  ++i) {
+            const EMF::SPixelRect &b = blocks[i];
+            unsigned int *data = r;
+            if (b.Width() < (unsigned int)w  ||  b.Height() < (unsigned int)h) {
+                b.Copy(tile, r, w);
+                data = &tile[0];
+            }
+            //(repeated images reuse the object already in the table)
+            EMFPLUS::SDrawImage image
+                (m_ObjectTable.GetImage(data, b.Width(), b.Height(),
+                                        m_RasterPNGLevel, m_File),
+                 b.Width(), b.Height(), x + b.m_Left*pw, y + b.m_Top*ph,
+                 data == r ? width : b.Width()*pw,
+                 data == r ? height : b.Height()*ph);
+            image.Write(m_File);
+        }
         if (rot != 0) {
             EMFPLUS::SResetWorldTransform trans;
             trans.Write(m_File);
@@ -631,8 +978,22 @@ void CDevEMF::Raster(unsigned int* r, int w, int h, double x, double y,
             emr.Write(m_File);
             x = 0; y = -height; //rotate around ll corner
         }
-        EMF::S_STRETCHBLT bmp(r, w,h,x,y,width,height);
-        bmp.Write(m_File);
+        for (unsigned int i = 0;  i < blocks.size();  ++i) {
+            const EMF::SPixelRect &b = blocks[i];
+            const unsigned int *data = r;
+            if (b.Width() < (unsigned int)w  ||  b.Height() < (unsigned int)h) {
+                b.Copy(tile, r, w);
+                data = &tile[0];
+            }
+            //(EMF has no bitmap objects, so repeated images are written
+            //again; pick smallest exact pixel encoding)
+            EMF::SRasterInfo info(data, b.Width(), b.Height(), false);
+            EMF::S_STRETCHBLT bmp(data, info, x + b.m_Left*pw,
+                                  y + b.m_Top*ph,
+                                  data == r ? width : b.Width()*pw,
+                                  data == r ? height : b.Height()*ph);
+            bmp.Write(m_File);
+        }
         if (rot != 0) {
             EMF::S_SETWORLDTRANSFORM emr;
             emr.xform.Set(1,0,0,1, 0,0);
@@ -658,20 +1019,22 @@ void CDevEMF::Line(double x1, double y1, double x2, double y2,
 void CDevEMF::Polyline(int n, double *x, double *y, const pGEcontext gc)
 {
     if (m_debug) Rprintf("polyline\n");
-
-    x_TransformY(y, n);//EMF has origin in upper left; R in lower left
-    if (m_UseEMFPlus) {
-        EMFPLUS::SDrawLines lines(n, x, y, x_GetPen(gc));
-        lines.Write(m_File);
-    } else {
-        x_GetPen(gc);
-        EMF::SPoly polyline(EMF::eEMR_POLYLINE, n, x, y);
-        polyline.Write(m_File);
-    }
+    x_FlushRects();
+    x_RoundCoords(n, x, y);
+    x_AddPolyline(n, x, y, gc);
 }
 
 void CDevEMF::Rect(double x0, double y0, double x1, double y1, const pGEcontext gc)
 {
+    if (m_UseEMFPlus  &&  !x_PatternFill(gc)) {
+        if (m_debug) Rprintf("rect\n");
+        if (m_RoundCoords) {
+            x0 = floor(x0 + 0.5);  y0 = floor(y0 + 0.5);
+            x1 = floor(x1 + 0.5);  y1 = floor(y1 + 0.5);
+        }
+        x_AddRect(x0, y0, x1, y1, gc);
+        return;
+    }
     if (m_debug) Rprintf("rect (converted to poly)\n");
 
     double x[4], y[4];
@@ -685,6 +1048,7 @@ void CDevEMF::Rect(double x0, double y0, double x1, double y1, const pGEcontext
 void CDevEMF::Circle(double x, double y, double r, const pGEcontext gc)
 {
     if (m_debug) Rprintf("circle (%f,%f r=%f)\n", x, y,r);
+    x_FlushPending();
 
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
     if (m_UseEMFPlus) {
@@ -710,10 +1074,25 @@ void CDevEMF::Circle(double x, double y, double r, const pGEcontext gc)
 void CDevEMF::Polygon(int n, double *x, double *y, const pGEcontext gc)
 {
     if (m_debug) { Rprintf("polygon"); for (int i = 0; i<n;  ++i) {Rprintf("(%f,%f) ", x[i], y[i]);}; Rprintf("\n");}
-
-    x_TransformY(y, n);//EMF has origin in upper left; R in lower left
-    if (m_UseEMFPlus) {
-        int pathId = m_ObjectTable.GetPath(new EMFPLUS::SPath(1,x,y,&n),m_File);
+    x_FlushPending();
+    x_RoundCoords(n, x, y);
+
+    //y is flipped (EMF has origin in upper left; R in lower left) as
+    //points are copied or written
+    EMFPLUS::SPath *path = m_UseEMFPlus ?
+        new EMFPLUS::SPath(1, x, y, &n, m_Height) : NULL;
+    if (path  &&  x_UseInlinePolygon(*path, gc)) {
+        delete path;
+        if (!R_TRANSPARENT(gc->fill)) {
+            EMFPLUS::SFillPolygon fill(n, x, y, gc->fill, m_Height);
+            fill.Write(m_File);
+        }
+        if (!R_TRANSPARENT(gc->col)) {
+            EMFPLUS::SDrawLines lines(n, x, y, x_GetPen(gc), true, m_Height);
+            lines.Write(m_File);
+        }
+    } else if (path) {
+        int pathId = m_ObjectTable.GetPath(path, m_File);
         int brushId = x_GetBrush(gc);
         if (brushId >= 0) {//not transparent
             EMFPLUS::SFillPath fill(pathId, brushId);
@@ -726,7 +1105,7 @@ void CDevEMF::Polygon(int n, double *x, double *y, const pGEcontext gc)
     } else {
         x_GetPen(gc);
         x_GetBrush(gc);
-        EMF::SPoly polygon(EMF::eEMR_POLYGON, n, x, y);
+        EMF::SPoly polygon(EMF::eEMR_POLYGON, n, x, y, m_Height);
         polygon.Write(m_File);
     }
 }
@@ -735,17 +1114,18 @@ void CDevEMF::Path(double *x, double *y, int nPoly, int *nPts, bool winding,
                    const pGEcontext gc)
 {
     if (m_debug) { Rprintf("path\t(%d subpaths w/ %i winding)", nPoly, winding?1:0); }
-
-    int n = 0;
+    x_FlushPending();
+    int total = 0;
     for (int i = 0;  i < nPoly;  ++i) {
-        n += nPts[i];
+        total += nPts[i];
     }
-    x_TransformY(y, n);//EMF has origin in upper left; R in lower left
+    x_RoundCoords(total, x, y);
 
     if (m_UseEMFPlus) {
         // I can't find a way to make use of "winding" in EMF+
-        int pathId = m_ObjectTable.GetPath(new EMFPLUS::SPath(nPoly,x,y,nPts),
-                                           m_File);
+        //(y is flipped as points are copied; EMF has origin in upper left)
+        int pathId = m_ObjectTable.GetPath
+            (new EMFPLUS::SPath(nPoly, x, y, nPts, m_Height), m_File);
         EMFPLUS::SDrawPath drawPath(pathId, x_GetPen(gc));
         drawPath.Write(m_File);
         int brushId = x_GetBrush(gc);
@@ -771,6 +1151,7 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
                        double hadj, const pGEcontext gc)
 {
     if (m_debug) Rprintf("textUTF8: %s, %x  at %.1f %.1f\n", str, gc->col, x, y);
+    x_FlushPending();
     x_TransformY(&y, 1);//EMF has origin in upper left; R in lower left
 
     SSysFontInfo *info = x_GetFontInfo(gc);
@@ -914,17 +1295,21 @@ void CDevEMF::TextUTF8(double x, double y, const char *str, double rot,
 
 
 static
-Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename, 
+Rboolean EMFDeviceDriver(pDevDesc dd, EMF::CSink *sink,
                          const char *bg, const char *fg,
                          double width, double height, double pointsize,
                          const char *family, int coordDPI, bool customLty,
                          bool emfPlus, bool emfpFont, bool emfpRaster,
-                         bool emfpEmbed)
+                         bool emfpEmbed, int emfpRasterPNG,
+                         double rasterOversample, int rasterTileSize,
+                         bool emfpRoundCoords)
 {
     CDevEMF *emf;
 
     if (!(emf = new CDevEMF(family, coordDPI, customLty, emfPlus, emfpFont,
-                            emfpRaster, emfpEmbed))){
+                            emfpRaster, emfpEmbed, emfpRasterPNG,
+                            rasterOversample, rasterTileSize,
+                            emfpRoundCoords))){
 	return FALSE;
     }
     dd->deviceSpecific = (void *) emf;
@@ -1004,15 +1389,20 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
     dd->deviceVersion = R_GE_definitions;
 #endif
 
-    if (!emf->Open(filename, dd->right, dd->top)) 
+    if (!emf->Open(sink, dd->right, dd->top)) {
+        delete emf; //(also deletes sink)
+        dd->deviceSpecific = NULL;
 	return FALSE;
+    }
 
     return TRUE;
 }
 
 /*  EMF Device Driver Parameters
  *  --------------------
- *  file    = output filename
+ *  file    = output filename, R connection, or (to keep output in
+ *            memory) an environment that receives it as raw vector
+ *            "emf" on close
  *  bg	    = background color
  *  fg	    = foreground color
  *  width   = width in inches
@@ -1023,18 +1413,30 @@ Rboolean EMFDeviceDriver(pDevDesc dd, const char *filename,
  *  emfPlus = whether to use EMF+ format
  *  emfpFont = whether to use EMF+ text records
  *  emfpRaster = whether to use EMF+ raster records
+ *  emfpEmbed = whether to convert text to EMF+ paths
+ *  emfpRasterPNG = zlib level (1-9) for PNG-compressing EMF+ rasters
+ *                  (0 = uncompressed)
+ *  rasterOversample = max raster pixels per device pixel (0 = no limit)
+ *  rasterTileSize = tile size for dropping transparent parts of rasters
+ *                   (0 = no tiling)
+ *  emz     = whether to gzip-compress output (EMZ format)
+ *  asyncWrite = whether to write output on a background thread
+ *  emfpRoundCoords = whether to round EMF+ coordinates to the device grid
  */
 extern "C" {
 SEXP devEMF(SEXP args)
 {
     pGEDevDesc dd;
-    const char *file, *bg, *fg, *family;
+    SEXP file;
+    const char *bg, *fg, *family;
     double height, width, pointsize;
-    Rboolean userLty, emfPlus, emfpFont, emfpRaster, emfpEmbed;
-    int coordDPI;
+    Rboolean userLty, emfPlus, emfpFont, emfpRaster, emfpEmbed, emz,
+        asyncWrite, emfpRoundCoords;
+    int coordDPI, emfpRasterPNG, rasterTileSize;
+    double rasterOversample;
 
     args = CDR(args); /* skip entry point name */
-    file = Rf_translateChar(Rf_asChar(CAR(args))); args = CDR(args);
+    file = CAR(args); args = CDR(args);
     bg = CHAR(Rf_asChar(CAR(args)));   args = CDR(args);
     fg = CHAR(Rf_asChar(CAR(args)));   args = CDR(args);
     width = Rf_asReal(CAR(args));	     args = CDR(args);
@@ -1047,16 +1449,81 @@ SEXP devEMF(SEXP args)
     emfpFont = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
     emfpRaster = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
     emfpEmbed = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    emfpRasterPNG = Rf_asInteger(CAR(args));     args = CDR(args);
+    rasterOversample = Rf_asReal(CAR(args));     args = CDR(args);
+    rasterTileSize = Rf_asInteger(CAR(args));     args = CDR(args);
+    emz = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    asyncWrite = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
+    emfpRoundCoords = (Rboolean) Rf_asLogical(CAR(args));     args = CDR(args);
 
     R_GE_checkVersionOrDie(R_GE_version);
     R_CheckDeviceAvailable();
+#ifndef HAVE_ZLIB
+    if (emz) {
+        Rf_error("emf: 'emz' output unavailable (compiled without zlib)");
+    }
+    if (emfpRasterPNG > 0) {
+        Rf_warning("emf: 'emfPlusRasterPNG' unavailable (compiled without "
+                   "zlib)");
+        emfpRasterPNG = 0;
+    }
+#endif
+    EMF::CSink *sink;
+    if (Rf_isEnvironment(file)) { //output to memory
+        sink = new EMF::CMemorySink(file);
+    } else if (Rf_inherits(file, "connection")) {
+        EMF::CConnectionSink *con = new EMF::CConnectionSink(file);
+        if (con->Ok()  &&  !con->Seekable()) {
+            delete con;
+            Rf_error("emf: connection must be able to seek (e.g., a file "
+                     "connection), to complete the EMF header when closing");
+        }
+        sink = con;
+    } else {
+        const char *filename =
+            R_ExpandFileName(Rf_translateChar(Rf_asChar(file)));
+        sink = new EMF::CFileSink(filename);
+        if (!sink->Ok()) {
+            delete sink;
+            Rf_error("emf: cannot open file '%s'", filename);
+        }
+    }
+    //check before wrapping, so a failed sink never gets a writer thread
+    if (!sink->Ok()) {
+        delete sink;
+        Rf_error("emf: cannot open output");
+    }
+#ifdef HAVE_ZLIB
+    if (emz) {
+        sink = new EMF::CGzipSink(sink);
+        if (!sink->Ok()) {
+            delete sink;
+            Rf_error("emf: cannot start gzip compression");
+        }
+    }
+#endif
+    if (asyncWrite) {
+#ifdef EMF_HAVE_THREADS
+        if (sink->CallsR()) {
+            Rf_warning("emf: 'asyncWrite' unavailable for connections");
+        } else {
+            sink = new EMF::CAsyncSink(sink);
+        }
+#else
+        Rf_warning("emf: 'asyncWrite' unavailable (compiled without C++11)");
+#endif
+    }
     BEGIN_SUSPEND_INTERRUPTS {
 	pDevDesc dev;
-	if (!(dev = (pDevDesc) calloc(1, sizeof(DevDesc))))
+	if (!(dev = (pDevDesc) calloc(1, sizeof(DevDesc)))) {
+            delete sink;
 	    return 0;
-	if(!EMFDeviceDriver(dev, file, bg, fg, width, height, pointsize,
+        }
+	if(!EMFDeviceDriver(dev, sink, bg, fg, width, height, pointsize,
                             family, coordDPI, userLty, emfPlus, emfpFont,
-                            emfpRaster, emfpEmbed)) {
+                            emfpRaster, emfpEmbed, emfpRasterPNG,
+                            rasterOversample, rasterTileSize,
+                            emfpRoundCoords)) {
 	    free(dev);
 	    Rf_error("unable to start %s() device", "emf");
 	}
@@ -1067,7 +1534,7 @@ SEXP devEMF(SEXP args)
 }
 
     const R_ExternalMethodDef ExtEntries[] = {
-        {"devEMF", (DL_FUNC)&devEMF, 13},
+        {"devEMF", (DL_FUNC)&devEMF, 19},
 	{NULL, NULL, 0}
     };
     void R_init_devEMF(DllInfo *dll) {
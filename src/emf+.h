@@ -29,6 +29,7 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <set>
 
 #include "emf.h"
 
@@ -44,6 +45,7 @@ namespace EMFPLUS {
         eRcdEndOfFile = 0x4002,
         eRcdGetDC = 0x4004,
         eRcdObject = 0x4008,
+        eRcdFillRects = 0x400A,
         eRcdDrawRects = 0x400B,
         eRcdFillPolygon = 0x400C,
         eRcdDrawLines = 0x400D,
@@ -74,6 +76,9 @@ namespace EMFPLUS {
         eTypeFont = 6,
         eTypeStringFormat = 7
     };
+    enum EObjectFlags {
+        eObjectContinued = 0x8000 //object data continues in next record
+    };
 
     enum EUnitType {
         eUnitWorld = 0,
@@ -189,6 +194,9 @@ namespace EMFPLUS {
     // EMF Objects used repeatedly
     const TUInt4 kVersion = 0xDBC01002; //specifies EMF+ and GDI+ version 1.1
     const unsigned int kMaxObjTableSize = 64; //max entries in object table
+    const unsigned int kMaxProtectedSlots = 48; //see CObjectTable
+    const unsigned int kMaxCommentSize = 1 << 16; //start new EMR_COMMENT after
+    const size_t kMaxObjectRecordSize = 1 << 15; //split larger objects
 
     struct SPointF {
         double x, y;
@@ -198,6 +206,73 @@ namespace EMFPLUS {
             return o << TFloat4(d.x) << TFloat4(d.y);
         }
     };
+    inline std::string& AppendPoints(std::string &o, const SPointF *p,
+                                     size_t n) {
+        const size_t start = o.size();
+        o.resize(start + n*8);
+        EMF::CCoordKernels::ToFloat(&o[start], &p->x, n); //(x,y) pairs
+        return o;
+    }
+    // points given as separate x & y arrays (flipping y if height > 0)
+    inline std::string& AppendPoints(std::string &o, const double *x,
+                                     const double *y, size_t n,
+                                     double height) {
+        const size_t start = o.size();
+        o.resize(start + n*8);
+        EMF::CCoordKernels::ToFloat(&o[start], x, y, n, height);
+        return o;
+    }
+
+    // Points (and rects) may instead be stored as 16-bit integers (the
+    // 'C' record flag), which is done whenever that loses nothing:
+    // every coordinate, as the float that would otherwise be written,
+    // is a whole number in range.  (The relative 'P' encoding is not
+    // used, as not all EMF+ readers support it.)
+    const unsigned short kCompressedFlag = 1 << 14;
+    inline bool IsInt16(double v) {
+        const float f = (float) v;
+        return f >= -32768  &&  f <= 32767  &&  f == floorf(f);
+    }
+    inline bool FitsInt16(const double *x, const double *y, size_t n,
+                          double height) {
+        for (size_t i = 0;  i < n;  ++i) {
+            if (!IsInt16(x[i])  ||
+                !IsInt16((height > 0) ? height - y[i] : y[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    inline std::string& AppendPoints(std::string &o, const SPointF *p,
+                                     size_t n, bool compressed) {
+        if (!compressed) {
+            return AppendPoints(o, p, n);
+        }
+        const size_t start = o.size();
+        o.resize(start + n*4);
+        char *dst = &o[start];
+        for (size_t i = 0;  i < n;  ++i, dst += 4) {
+            EMF::PutLE<short>(dst, (short) (float) p[i].x);
+            EMF::PutLE<short>(dst + 2, (short) (float) p[i].y);
+        }
+        return o;
+    }
+    inline std::string& AppendPoints(std::string &o, const double *x,
+                                     const double *y, size_t n,
+                                     double height, bool compressed) {
+        if (!compressed) {
+            return AppendPoints(o, x, y, n, height);
+        }
+        const size_t start = o.size();
+        o.resize(start + n*4);
+        char *dst = &o[start];
+        for (size_t i = 0;  i < n;  ++i, dst += 4) {
+            EMF::PutLE<short>(dst, (short) (float) x[i]);
+            EMF::PutLE<short>(dst + 2, (short) (float)
+                              ((height > 0) ? height - y[i] : y[i]));
+        }
+        return o;
+    }
 
     struct SRectF {
         double x, y, w, h;
@@ -239,35 +314,113 @@ namespace EMFPLUS {
         virtual std::string& Serialize(std::string &o) const {
             return o << TUInt2(iType) << TUInt2(iFlags) << nSize << nDataSize;
         }
+        // bulk data streamed after Serialize's output (as for EMF records)
+        virtual size_t PayloadSize(void) const { return 0; }
+        virtual void AppendPayload(std::string &, size_t) const {}
         void Write(EMF::ofstream &o) {
-            if (!o.inEMFplus) { //write encapsulating EMF record
-                EMF::SPlusRecord emr;
-                emr.Write(o);
-                o.emfPlusStartPos = o.tellp();
-                o.inEMFplus = true;
+            if (PayloadSize() > 0  &&  iType != eRcdObject) {
+                x_WriteStreamed(o);
+                return;
             }
-            std::string buff; Serialize(buff);
-            buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
-            std::string dataSize; dataSize << TUInt4(buff.size()-12);
-            std::string finalSize; finalSize << TUInt4(buff.size());
-            buff.replace(4,4, finalSize);
-            buff.replace(8,4, dataSize);
-            o.write(buff.data(), buff.size());
-
-            // update the size of the encapsulating EMF record
-            std::streampos currPos = o.tellp();
-            // back up to Size field
-            o.seekp(o.emfPlusStartPos - (std::streampos)12);
-            buff.clear();
-            buff << TUInt4((int)(currPos - o.emfPlusStartPos) + 16)
-                 << TUInt4((int)(currPos - o.emfPlusStartPos) + 4);
-            o.write(buff.data(), buff.size());
-            o.seekp(currPos);
-
+            const size_t start = x_BeginRecord(o);
+            //serialize directly into the stream buffer & patch sizes in place
+            Serialize(o.buff);
+            if (iType == eRcdObject  &&  o.buff.size() - start +
+                PayloadSize() > kMaxObjectRecordSize) {
+                x_WriteContinued(o, start);
+                return;
+            }
+            x_EndRecord(o, start);
+        }
+    private:
+        // returns where the record starts in the stream buffer
+        size_t x_BeginRecord(EMF::ofstream &o) const {
+            if (!o.plusCommentOpen) { //write encapsulating EMF record
+                o.inEMFplus = false; //no GetDC between adjacent comments
+                //(serialized rather than written, as writing could flush
+                //the buffer before the comment is marked open)
+                o.plusCommentStart = o.buff.size();
+                o.plusCommentOpen = true;
+                ++o.nRecords;
+                EMF::SPlusRecord().Serialize(o.buff);
+            }
+            o.inEMFplus = true;
+            return o.buff.size();
+        }
+        void x_EndRecord(EMF::ofstream &o, size_t start) const {
+            o.buff.resize(start + ((o.buff.size() - start + 3)/4)*4,
+                          '\0'); //add padding
+            TUInt4 sizes[2] = {TUInt4(o.buff.size() - start),
+                               TUInt4(o.buff.size() - start - 12)};
+            o.buff.replace(start+4, 4, sizes[0].m_Val, 4);
+            o.buff.replace(start+8, 4, sizes[1].m_Val, 4);
+
+            // encapsulating EMF record is sized once, when closed
             if (iType == eRcdEndOfFile) {
+                o.ClosePlusComment();
                 o.inEMFplus = false;
+            } else if (o.buff.size() - o.plusCommentStart >= kMaxCommentSize) {
+                o.ClosePlusComment();
+            }
+        }
+        // object too large for one record (serialized from "start" in
+        // the stream buffer, plus any payload): split into continuable
+        // object records, each with the continuation flag & total object
+        // size (set in every part, as GDI+ does).  Parts are produced as
+        // the payload is, so only about kPayloadChunkSize is held.
+        void x_WriteContinued(EMF::ofstream &o, size_t start) const {
+            const size_t kPartSize = kMaxObjectRecordSize - 16;
+            std::string pending(o.buff, start + 12, std::string::npos);
+            o.buff.resize(start);
+            const size_t payload = PayloadSize();
+            const size_t total = pending.size() + payload;
+            size_t pos = 0, produced = 0;
+            for (size_t done = 0;  done < total;  ) {
+                if (pending.size() - pos < kPartSize  &&  produced < payload) {
+                    pending.erase(0, pos);
+                    pos = 0;
+                    while (pending.size() < kPartSize  &&  produced < payload) {
+                        const size_t before = pending.size();
+                        AppendPayload(pending, produced);
+                        produced += pending.size() - before;
+                    }
+                }
+                const size_t n = std::min(kPartSize, pending.size() - pos);
+                const size_t partStart = x_BeginRecord(o);
+                o.buff << TUInt2(iType) << TUInt2(iFlags | eObjectContinued) <<
+                    TUInt4(0) << TUInt4(0) << TUInt4(total);
+                o.buff.append(pending, pos, n);
+                pos += n;
+                done += n;
+                x_EndRecord(o, partStart);
             }
         }
+        // record with a payload: gets an encapsulating EMF record of its
+        // own, sized up front, so the payload can be streamed out
+        void x_WriteStreamed(EMF::ofstream &o) {
+            o.ClosePlusComment();
+            o.inEMFplus = false; //no GetDC between adjacent comments
+            //(serialized rather than written, as writing could flush
+            //the buffer before the sizes are patched)
+            const size_t commentStart = o.buff.size();
+            ++o.nRecords;
+            EMF::SPlusRecord().Serialize(o.buff);
+            const size_t start = o.buff.size();
+            Serialize(o.buff);
+            const size_t payload = PayloadSize();
+            const size_t size = o.buff.size() - start + payload;
+            const size_t paddedSize = ((size + 3)/4)*4;
+            TUInt4 sizes[4] = {TUInt4(paddedSize + 16), TUInt4(paddedSize + 4),
+                               TUInt4(paddedSize), TUInt4(paddedSize - 12)};
+            o.buff.replace(commentStart+4, 4, sizes[0].m_Val, 4);
+            o.buff.replace(commentStart+8, 4, sizes[1].m_Val, 4);
+            o.buff.replace(start+4, 4, sizes[2].m_Val, 4);
+            o.buff.replace(start+8, 4, sizes[3].m_Val, 4);
+            o.StreamPayload(*this, payload);
+            o.buff.append(paddedSize - size, '\0'); //add padding
+            o.inEMFplus = true;
+            o.MaybeFlush();
+        }
     };
 
     struct SHeader : SRecord {
@@ -418,8 +571,15 @@ namespace EMFPLUS {
 
     struct SObject : SRecord {
         EObjectType type;
-        SObject(EObjectType t) : SRecord(eRcdObject), type(t) {}
+        unsigned long long m_Hash; //ContentHash(), set by the object table
+        SObject(EObjectType t) : SRecord(eRcdObject), type(t), m_Hash(0) {}
         virtual ~SObject(void) {}
+        // equality of contents (i.e. ignoring the object id)
+        virtual unsigned long long ContentHash(void) const = 0;
+        virtual bool SameAs(const SObject &o) const = 0;
+        // called once the object has been written & put in the table
+        // (after which it is only used for comparisons)
+        virtual void Kept(void) {}
         void SetObjId(unsigned char id) {
             iFlags = ((unsigned int)type << 8) | id;
         }
@@ -439,9 +599,6 @@ namespace EMFPLUS {
         struct SBlend {
             double pos;
             SColorRef col;
-            friend bool operator< (const SBlend &b1, const SBlend &b2) {
-                return memcmp(&b1, &b2, sizeof(SBlend)) < 0;
-            }
         };
         std::vector<SBlend> blendVector;
         SBrush(unsigned int c) : SObject(eTypeBrush),
@@ -470,9 +627,47 @@ namespace EMFPLUS {
                 throw std::logic_error("unhandled brush type");
             }
         }
-        friend bool operator< (const SBrush& b1, const SBrush& b2) {
-            int cmp = memcmp(&b1.brushType, &b2.brushType, (char*)(&b1.blendVector) - (char*)&b1.brushType);
-            return (cmp < 0 || (cmp == 0  &&  b1.blendVector < b2.blendVector));
+        //field by field, as solid brushes leave the gradient unset
+        unsigned long long ContentHash(void) const {
+            EMF::CHasher h;
+            h.Add(type).Add(brushType).Add(color);
+            if (brushType != eBrushTypeSolidColor) {
+                h.Add(wrapMode).Add(gradCoords.x).Add(gradCoords.y).
+                    Add(gradCoords.w).Add(gradCoords.h);
+                for (unsigned int i = 0;  i < blendVector.size();  ++i) {
+                    h.Add(blendVector[i].pos).Add(blendVector[i].col);
+                }
+            }
+            return h.Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.type != type) {
+                return false;
+            }
+            const SBrush &b = static_cast<const SBrush&>(o);
+            if (b.brushType != brushType  ||
+                memcmp(&b.color, &color, sizeof(color)) != 0) {
+                return false;
+            }
+            if (brushType == eBrushTypeSolidColor) {
+                return true;
+            }
+            if (b.wrapMode != wrapMode  ||
+                b.gradCoords.x != gradCoords.x  ||
+                b.gradCoords.y != gradCoords.y  ||
+                b.gradCoords.w != gradCoords.w  ||
+                b.gradCoords.h != gradCoords.h  ||
+                b.blendVector.size() != blendVector.size()) {
+                return false;
+            }
+            for (unsigned int i = 0;  i < blendVector.size();  ++i) {
+                if (b.blendVector[i].pos != blendVector[i].pos  ||
+                    memcmp(&b.blendVector[i].col, &blendVector[i].col,
+                           sizeof(SColorRef)) != 0) {
+                    return false;
+                }
+            }
+            return true;
         }
     };
 
@@ -485,6 +680,7 @@ namespace EMFPLUS {
         TFloat4 miterLimit;
         TUInt4 lineStyle;
         TUInt4 dashedCap;
+        enum { kFixedSize = 28 }; //bytes of the 4-byte fields above
         std::vector<double> dashedLineData; //for custom line style
         std::string& Serialize(std::string &o) const {
             o << TUInt4(ePenStartCap | ePenEndCap | ePenJoin | ePenMiterLimit |
@@ -514,6 +710,19 @@ namespace EMFPLUS {
             o << kVersion << TUInt4(0) /*SOLID*/ << brush;
             return o;
         }
+        unsigned long long ContentHash(void) const {
+            return EMF::CHasher().Add(type).Add(&pen, SPenData::kFixedSize).
+                Add(pen.dashedLineData).Add(brush).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.type != type) {
+                return false;
+            }
+            const SPen &p = static_cast<const SPen&>(o);
+            return memcmp(&p.pen, &pen, SPenData::kFixedSize) == 0  &&
+                p.pen.dashedLineData == pen.dashedLineData  &&
+                memcmp(&p.brush, &brush, sizeof(brush)) == 0;
+        }
     };
 
     struct SFont : SObject {
@@ -536,6 +745,18 @@ namespace EMFPLUS {
             o.append(m_FamilyUTF16);
             return o;
         }
+        unsigned long long ContentHash(void) const {
+            return EMF::CHasher().Add(type).Add(m_emSize).Add(m_Style).
+                Add(m_FamilyUTF16).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.type != type) {
+                return false;
+            }
+            const SFont &f = static_cast<const SFont&>(o);
+            return f.m_emSize == m_emSize  &&  f.m_Style == m_Style  &&
+                f.m_FamilyUTF16 == m_FamilyUTF16;
+        }
     };
 
     struct SStringFormat : SObject {
@@ -562,6 +783,16 @@ namespace EMFPLUS {
               << TUInt4(0); // object doesn't provide any range data
             return o;
         }        
+        unsigned long long ContentHash(void) const {
+            return EMF::CHasher().Add(type).Add(m_Horiz).Add(m_Vert).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.type != type) {
+                return false;
+            }
+            const SStringFormat &f = static_cast<const SStringFormat&>(o);
+            return f.m_Horiz == m_Horiz  &&  f.m_Vert == m_Vert;
+        }
     };
 
     struct SPath : SObject {
@@ -569,12 +800,18 @@ namespace EMFPLUS {
         std::vector<EPathPointType> m_PtType;
         std::vector<unsigned int> m_NPointsPerPoly;
         unsigned int m_TotalPts;
+        bool m_Closed; //false if the polys are open figures (polylines)
+        bool m_FitsInt16; //all points can be stored as 16-bit integers
         
         SPath(void) : SObject(eTypePath) {
             m_TotalPts = 0;
+            m_Closed = true;
+            m_FitsInt16 = true;
         }
-        SPath(unsigned int nPoly, double *x, double *y, int *nPts) :
-        SObject(eTypePath) {
+        //y is flipped to height - y if height > 0
+        SPath(unsigned int nPoly, const double *x, const double *y,
+              const int *nPts, double height = 0, bool closed = true) :
+        SObject(eTypePath), m_Closed(closed), m_FitsInt16(true) {
             m_NPointsPerPoly.reserve(nPoly);
             m_TotalPts = 0;
             for (unsigned int i = 0;  i < nPoly;  ++i) {
@@ -584,7 +821,8 @@ namespace EMFPLUS {
             m_Points.resize(m_TotalPts);
             for (unsigned int i = 0;  i < m_TotalPts;  ++i) {
                 m_Points[i].x = x[i];
-                m_Points[i].y = y[i];
+                m_Points[i].y = (height > 0) ? height - y[i] : y[i];
+                x_Track(m_Points[i]);
             }
             m_PtType.resize(m_TotalPts, ePathPointTypeLine);
             unsigned int ptI = 0;
@@ -598,6 +836,7 @@ namespace EMFPLUS {
             ++m_TotalPts;
             m_Points.push_back(SPointF(x, y));
             m_PtType.push_back(ePathPointTypeStart);
+            x_Track(m_Points.back());
         }
         void AddLineTo(double x, double y) {
             if (m_NPointsPerPoly.empty()) {
@@ -607,6 +846,7 @@ namespace EMFPLUS {
             ++m_TotalPts;
             m_Points.push_back(SPointF(x, y));
             m_PtType.push_back(ePathPointTypeLine);
+            x_Track(m_Points.back());
         }
         void AddCubicBezierTo(double cx0, double cy0,
                               double cx1, double cy1,
@@ -622,6 +862,9 @@ namespace EMFPLUS {
             m_PtType.push_back(ePathPointTypeBezier);
             m_Points.push_back(SPointF(x, y));
             m_PtType.push_back(ePathPointTypeBezier);
+            for (size_t i = m_Points.size() - 3;  i < m_Points.size();  ++i) {
+                x_Track(m_Points[i]);
+            }
         }
         void AddQuadBezierTo(double cx, double cy,
                              double x, double y) {
@@ -645,100 +888,213 @@ namespace EMFPLUS {
         }
         std::string& Serialize(std::string &o) const {
             SObject::Serialize(o);
-            o << kVersion << TUInt4(m_TotalPts) << TUInt4(0);
-            for (unsigned int i = 0;  i < m_TotalPts;  ++i) {
-                o << m_Points[i];
+            o << kVersion << TUInt4(m_TotalPts)
+              << TUInt4(m_FitsInt16 ? kCompressedFlag : 0);
+            if (PayloadSize() > 0) {
+                return o; //points & types streamed
             }
-            unsigned int polyStart = 0;
-            for (unsigned int i = 0;  i < m_NPointsPerPoly.size();  ++i) {
-                for (unsigned int j = 0;  j < m_NPointsPerPoly[i];  ++j) {
-                    if (j < m_NPointsPerPoly[i] - 1) { //normal point
-                        o << TUInt1((0x2 << 4) | m_PtType[j+polyStart]);
-                    } else {//close path
-                        o << TUInt1((0x8 << 4) | m_PtType[j+polyStart]); 
-                    }
-                }
-                polyStart += m_NPointsPerPoly[i];
+            AppendPoints(o, m_Points.data(), m_TotalPts, m_FitsInt16);
+            return x_AppendTypes(o, 0, m_TotalPts);
+        }
+        size_t PayloadSize(void) const {
+            const size_t size = (x_PointSize() + 1)*(size_t)m_TotalPts;
+            return (size > EMF::kPayloadChunkSize) ? size : 0;
+        }
+        void AppendPayload(std::string &o, size_t done) const {
+            const size_t ptSize = x_PointSize();
+            const size_t pointsSize = ptSize*(size_t)m_TotalPts;
+            if (done < pointsSize) {
+                const size_t i = done/ptSize;
+                AppendPoints(o, &m_Points[i], std::min<size_t>
+                             (m_TotalPts - i, EMF::kPayloadChunkSize/ptSize),
+                             m_FitsInt16);
+            } else {
+                const size_t i = done - pointsSize;
+                x_AppendTypes(o, i, std::min<size_t>
+                              (m_TotalPts - i, EMF::kPayloadChunkSize));
             }
-            return o;
         }
-        friend bool operator< (const SPath& p1, const SPath& p2) {
-            if (p1.m_TotalPts < p2.m_TotalPts) {
-                return true;
-            } else if (p1.m_TotalPts > p2.m_TotalPts) {
-                return false;
-            }
-            int cmp = memcmp(p1.m_Points.data(),  p2.m_Points.data(),
-                             sizeof(SPointF)*p1.m_TotalPts);
-            if (cmp < 0) {
-                return true;
-            } else if (cmp > 0) {
+        // (the points are hashed once, and compared only when the
+        // hashes match)
+        unsigned long long ContentHash(void) const {
+            return EMF::CHasher().Add(type).Add(m_Points).Add(m_PtType).
+                Add(m_NPointsPerPoly).Add(m_Closed).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.type != type) {
                 return false;
             }
-            cmp = memcmp(p1.m_PtType.data(),  p2.m_PtType.data(),
-                         sizeof(EPathPointType)*p1.m_TotalPts);
-            if (cmp < 0) {
-                return true;
-            } else if (cmp > 0) {
-                return false;
+            const SPath &p = static_cast<const SPath&>(o);
+            return p.m_TotalPts == m_TotalPts  &&  p.m_Closed == m_Closed  &&
+                p.m_NPointsPerPoly == m_NPointsPerPoly  &&
+                memcmp(p.m_Points.data(), m_Points.data(),
+                       sizeof(SPointF)*m_TotalPts) == 0  &&
+                memcmp(p.m_PtType.data(), m_PtType.data(),
+                       sizeof(EPathPointType)*m_TotalPts) == 0;
+        }
+    private:
+        void x_Track(const SPointF &p) {
+            m_FitsInt16 = m_FitsInt16  &&  IsInt16(p.x)  &&  IsInt16(p.y);
+        }
+        size_t x_PointSize(void) const { return m_FitsInt16 ? 4 : 8; }
+        // appends the types of points [first, first + n)
+        std::string& x_AppendTypes(std::string &o, size_t first,
+                                   size_t n) const {
+            const size_t start = o.size();
+            o.resize(start + n);
+            char *dst = &o[start];
+            size_t polyStart = 0;
+            for (unsigned int i = 0;  i < m_NPointsPerPoly.size()  &&
+                     polyStart < first + n;  ++i) {
+                const size_t polyEnd = polyStart + m_NPointsPerPoly[i];
+                for (size_t j = std::max(first, polyStart);
+                     j < std::min(first + n, polyEnd);  ++j) {
+                    if (j < polyEnd - 1  ||  !m_Closed) { //normal point
+                        dst[j - first] = (0x2 << 4) | m_PtType[j];
+                    } else {//close path
+                        dst[j - first] = (0x8 << 4) | m_PtType[j];
+                    }
+                }
+                polyStart = polyEnd;
             }
-            
-            return (memcmp(p1.m_NPointsPerPoly.data(),
-                           p2.m_NPointsPerPoly.data(),
-                           sizeof(unsigned int)*p1.m_NPointsPerPoly.size())
-                    < 0);
+            return o;
         }
     };
              
+    // (point arrays below are not owned: they must stay valid until the
+    // record is written; y is flipped to height - y if height > 0)
     struct SFillPolygon : SRecord {
         SColorRef m_Brush;
         unsigned int m_Count;
-        SPointF *m_Points;
-        SFillPolygon(int n, double *x, double *y,
-                     unsigned int col) :
-            SRecord(eRcdFillPolygon), m_Brush(col), m_Points(new SPointF[n]) {
+        const double *m_X, *m_Y;
+        double m_Height;
+        bool m_Compressed;
+        SFillPolygon(int n, const double *x, const double *y,
+                     unsigned int col, double height = 0) :
+            SRecord(eRcdFillPolygon), m_Brush(col), m_Count(n),
+            m_X(x), m_Y(y), m_Height(height),
+            m_Compressed(FitsInt16(x, y, n, height)) {
             iFlags = 1 << 15; //specify solid brush, color given here
-            m_Count = n;
-            for (unsigned int i = 0;  i < m_Count;  ++i) {
-                m_Points[i].x = x[i];
-                m_Points[i].y = y[i];
+            if (m_Compressed) {
+                iFlags |= kCompressedFlag;
             }
         }
-        ~SFillPolygon(void) { delete[] m_Points; }
         std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o);
             o << m_Brush << TUInt4(m_Count);
-            for (unsigned int i = 0;  i < m_Count;  ++i) {
-                o << m_Points[i];
+            if (PayloadSize() > 0) {
+                return o; //points streamed
             }
-            return o;
+            return AppendPoints(o, m_X, m_Y, m_Count, m_Height, m_Compressed);
 	}
+        size_t PayloadSize(void) const {
+            const size_t size = (m_Compressed ? 4 : 8)*(size_t)m_Count;
+            return (size > EMF::kPayloadChunkSize) ? size : 0;
+        }
+        void AppendPayload(std::string &o, size_t done) const {
+            const size_t ptSize = m_Compressed ? 4 : 8;
+            const size_t i = done/ptSize;
+            AppendPoints(o, m_X + i, m_Y + i, std::min<size_t>
+                         (m_Count - i, EMF::kPayloadChunkSize/ptSize),
+                         m_Height, m_Compressed);
+        }
     };
 
     struct SDrawLines : SRecord {
-        unsigned int count;
-        SPointF *points;
-        SDrawLines(int n, double *x, double *y, unsigned char penId,
-                   bool close = false) :
-            SRecord(eRcdDrawLines), points(new SPointF[n+(close?1:0)]) {
+        unsigned int n;
+        const double *x, *y;
+        double height;
+        bool compressed;
+        SDrawLines(int nn, const double *xx, const double *yy,
+                   unsigned char penId, bool close = false, double h = 0) :
+            SRecord(eRcdDrawLines), n(nn), x(xx), y(yy), height(h),
+            compressed(FitsInt16(xx, yy, nn, h)) {
             iFlags = penId;
-            count = n + (close?1:0);
-            for (int i = 0;  i < n;  ++i) {
-                points[i].x = x[i];
-                points[i].y = y[i];
-            }
             if (close) {
-                points[n].x = x[0];
-                points[n].y = y[0];
+                iFlags |= 1 << 13; //join last point back to the first
+            }
+            if (compressed) {
+                iFlags |= kCompressedFlag;
             }
         }
-        ~SDrawLines(void) { delete[] points; }
         std::string& Serialize(std::string &o) const {
-            SRecord::Serialize(o) << TUInt4(count);
-            for (unsigned int i = 0;  i < count;  ++i) {
-                o << points[i];
+            SRecord::Serialize(o) << TUInt4(n);
+            if (PayloadSize() > 0) {
+                return o; //points streamed
             }
-            return o;
+            return AppendPoints(o, x, y, n, height, compressed);
+	}
+        size_t PayloadSize(void) const {
+            const size_t size = (compressed ? 4 : 8)*(size_t)n;
+            return (size > EMF::kPayloadChunkSize) ? size : 0;
+        }
+        void AppendPayload(std::string &o, size_t done) const {
+            const size_t ptSize = compressed ? 4 : 8;
+            const size_t i = done/ptSize;
+            AppendPoints(o, x + i, y + i, std::min<size_t>
+                         (n - i, EMF::kPayloadChunkSize/ptSize), height,
+                         compressed);
+        }
+    };
+
+    // (rectangle list is not owned, as for the point arrays above)
+    inline bool FitsInt16(const std::vector<SRectF> &rects) {
+        for (size_t i = 0;  i < rects.size();  ++i) {
+            const SRectF &r = rects[i];
+            if (!IsInt16(r.x)  ||  !IsInt16(r.y)  ||  !IsInt16(r.w)  ||
+                !IsInt16(r.h)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    inline std::string& AppendRects(std::string &o,
+                                    const std::vector<SRectF> &rects,
+                                    bool compressed) {
+        for (size_t i = 0;  i < rects.size();  ++i) {
+            const SRectF &r = rects[i];
+            if (compressed) {
+                o << TUInt2((short) (float) r.x) << TUInt2((short) (float) r.y)
+                  << TUInt2((short) (float) r.w) << TUInt2((short) (float) r.h);
+            } else {
+                o << r;
+            }
+        }
+        return o;
+    }
+
+    struct SFillRects : SRecord {
+        SColorRef m_Brush;
+        const std::vector<SRectF> &m_Rects;
+        bool m_Compressed;
+        SFillRects(const std::vector<SRectF> &rects, unsigned int col) :
+            SRecord(eRcdFillRects), m_Brush(col), m_Rects(rects),
+            m_Compressed(FitsInt16(rects)) {
+            iFlags = 1 << 15; //specify solid brush, color given here
+            if (m_Compressed) {
+                iFlags |= kCompressedFlag;
+            }
+        }
+        std::string& Serialize(std::string &o) const {
+            SRecord::Serialize(o) << m_Brush << TUInt4(m_Rects.size());
+            return AppendRects(o, m_Rects, m_Compressed);
+	}
+    };
+
+    struct SDrawRects : SRecord {
+        const std::vector<SRectF> &m_Rects;
+        bool m_Compressed;
+        SDrawRects(const std::vector<SRectF> &rects, unsigned char penId) :
+            SRecord(eRcdDrawRects), m_Rects(rects),
+            m_Compressed(FitsInt16(rects)) {
+            iFlags = penId;
+            if (m_Compressed) {
+                iFlags |= kCompressedFlag;
+            }
+        }
+        std::string& Serialize(std::string &o) const {
+            SRecord::Serialize(o) << TUInt4(m_Rects.size());
+            return AppendRects(o, m_Rects, m_Compressed);
 	}
     };
 
@@ -864,30 +1220,100 @@ namespace EMFPLUS {
 	}
     };
 
+    enum EPixelFormat {
+        ePixelFormat8bppIndexed = 0x00030803,
+        ePixelFormat24bppRGB = 0x00021808,
+        ePixelFormat32bppARGB = 0x0026200A
+    };
+    enum EPaletteFlags {
+        ePaletteHasAlpha = 1
+    };
+
     struct SImage : SObject {
+        //not owned: only valid until the object is written (the
+        //caller's buffer may then be reused, e.g. for the next tile), so
+        //kept images are compared by size and a 128-bit content hash
+        const unsigned int *m_Data;
         unsigned int m_W, m_H;
-        std::string m_RawARGB;
-        SImage(unsigned int *data, unsigned int w, unsigned int h) :
-        SObject(eTypeImage) {
-            m_W = w;
-            m_H = h;
-            m_RawARGB.resize(w*h*4);
-            for (unsigned int i = 0;  i < m_W*m_H; ++i) {
-                m_RawARGB[4*i+0] = R_BLUE(data[i]);
-                m_RawARGB[4*i+1] = R_GREEN(data[i]);
-                m_RawARGB[4*i+2] = R_RED(data[i]);
-                m_RawARGB[4*i+3] = R_ALPHA(data[i]);
+        unsigned long long m_PixelHash[2];
+        int m_PNGLevel; //zlib level for PNG compression (0 = none)
+        SImage(const unsigned int *data, unsigned int w, unsigned int h,
+               int pngLevel = 0) :
+            SObject(eTypeImage), m_Data(data), m_W(w), m_H(h),
+            m_PNGLevel(pngLevel), m_Info(NULL) {
+            m_PixelHash[0] = EMF::CHasher::Bytes(data, 4*(size_t)w*h);
+            m_PixelHash[1] = EMF::CHasher::Bytes(data, 4*(size_t)w*h,
+                                                 kPixelHashSeed);
+        }
+        ~SImage(void) { delete m_Info; }
+        unsigned long long ContentHash(void) const {
+            return EMF::CHasher().Add(type).Add(m_PixelHash[0]).Add(m_W).
+                Add(m_H).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.type != type) {
+                return false;
             }
+            const SImage &i = static_cast<const SImage&>(o);
+            return i.m_PixelHash[0] == m_PixelHash[0]  &&
+                i.m_PixelHash[1] == m_PixelHash[1]  &&  i.m_W == m_W  &&
+                i.m_H == m_H;
         }
+        void Kept(void) { m_Data = NULL; } //(caller's buffer not kept)
         std::string& Serialize(std::string &o) const {
+            const EMF::SRasterInfo &info = x_Info();
+            EPixelFormat format = (info.m_BitCount == 8) ?
+                ePixelFormat8bppIndexed : (info.m_BitCount == 24) ?
+                ePixelFormat24bppRGB : ePixelFormat32bppARGB;
             SObject::Serialize(o) << kVersion << TUInt4(1) <<
-                TUInt4(m_W) << TUInt4(m_H) << TUInt4(4*m_W) <<
-                TUInt4(0x26200A) <<
-                //TUInt4(32 << 16 | 10 << 24) << 
-                TUInt4(0);
-            o.append(m_RawARGB);
+                TUInt4(info.m_W) << TUInt4(info.m_H) <<
+                TUInt4(info.Stride()) << TUInt4(format);
+#ifdef HAVE_ZLIB
+            if (m_PNGLevel > 0) {
+                const size_t paletteSize = (info.m_BitCount == 8) ?
+                    8 + 4*info.NColors() : 0;
+                const size_t typeStart = o.size();
+                o << TUInt4(1); //compressed bitmap data
+                if (EMF::CPngEncoder::Encode(o, m_Data, info.m_W, info.m_H,
+                                             m_PNGLevel,
+                                             paletteSize + info.Size())) {
+                    return o;
+                }
+                o.resize(typeStart); //PNG not smaller: fall back to raw
+            }
+#endif
+            o << TUInt4(0); //raw pixel data
+            if (info.m_BitCount == 8) {
+                o << TUInt4(info.m_Opaque ? 0 : ePaletteHasAlpha) <<
+                    TUInt4(info.NColors());
+            }
+            if (PayloadSize() == 0) {
+                info.AppendData(o, m_Data, 0, info.DataSize(), true);
+            }
             return o;
 	}
+        // (PNG compression needs the whole image, so is never streamed)
+        size_t PayloadSize(void) const {
+            const size_t size = x_Info().DataSize();
+            return (m_PNGLevel == 0  &&  size > EMF::kPayloadChunkSize) ?
+                size : 0;
+        }
+        void AppendPayload(std::string &o, size_t done) const {
+            x_Info().AppendData(o, m_Data, done, EMF::kPayloadChunkSize,
+                                true);
+        }
+    private:
+        //pick smallest exact pixel encoding (palettes can hold alpha);
+        //done only when the image is written, not for repeated images
+        const EMF::SRasterInfo& x_Info(void) const {
+            if (!m_Info) {
+                m_Info = new EMF::SRasterInfo(m_Data, m_W, m_H, true);
+            }
+            return *m_Info;
+        }
+        static const unsigned long long kPixelHashSeed =
+            0x9E3779B97F4A7C15ULL;
+        mutable EMF::SRasterInfo *m_Info;
     };
 
     SPen::SPen(unsigned int col, double lwd, unsigned int lty,
@@ -936,74 +1362,31 @@ namespace EMFPLUS {
         pen.miterLimit = lmitre;
     }
 
-    struct ObjectPtrCmp {
-        bool operator() (const SObject* o1, const SObject* o2) const {
-            if (o1->type < o2->type) {
-                return true;
-            } else if (o1->type > o2->type) {
-                return false;
-            } else { //same type -- so compare details
-                switch (o1->type) {
-                case eTypeBrush:
-                    return *dynamic_cast<const SBrush*>(o1) <
-                        *dynamic_cast<const SBrush*>(o2);
-                case eTypePen: {
-                    const SPen *p1 = dynamic_cast<const SPen*>(o1);
-                    const SPen *p2 = dynamic_cast<const SPen*>(o2);
-                    int cmp = memcmp(&p1->pen, &p2->pen, 28);//not ideal..
-                    if (cmp == 0) {
-                        if (p1->pen.dashedLineData < p2->pen.dashedLineData)
-                            return true;
-                        else if (p1->pen.dashedLineData >
-                                 p2->pen.dashedLineData)
-                            return false;
-                    }
-
-                    return (cmp < 0  ||
-                            (cmp == 0  &&
-                             memcmp(&p1->brush, &p2->brush,
-                                    sizeof(p1->brush)) < 0));
-                }
-                case eTypeFont: {
-                    const SFont* f1 = dynamic_cast<const SFont*>(o1);
-                    const SFont* f2 = dynamic_cast<const SFont*>(o2);
-                    return f1->m_emSize < f2->m_emSize  ||
-                        (f1->m_emSize == f2->m_emSize  &&
-                         (f1->m_Style < f2->m_Style  ||
-                          (f1->m_Style == f2->m_Style  &&
-                           f1->m_FamilyUTF16 < f2->m_FamilyUTF16)));
-                }
-                case eTypeStringFormat: {
-                    const SStringFormat* s1 =
-                        dynamic_cast<const SStringFormat*>(o1);
-                    const SStringFormat* s2 =
-                        dynamic_cast<const SStringFormat*>(o2);
-                    return s1->m_Horiz < s2->m_Horiz  ||
-                        (s1->m_Horiz == s2->m_Horiz  &&
-                         s1->m_Vert < s2->m_Vert);
-                }
-                case eTypePath: {
-                    return *dynamic_cast<const SPath*>(o1) <
-                        *dynamic_cast<const SPath*>(o2);
-                }
-                case eTypeImage: {
-                    return false; //assume images are unique
-                }
-                default: {//should never happen!
-                    throw std::logic_error("EMF+ object table scrambled");
-                }
-                }
-            }
-        }
+    // Counts for one object type, to judge how well the table works.
+    struct SObjectStats {
+        unsigned long m_Requests; //objects asked for
+        unsigned long m_Written; //objects written to the file...
+        unsigned long m_Rewritten; //...that had been evicted earlier
+        SObjectStats(void) : m_Requests(0), m_Written(0), m_Rewritten(0) {}
     };
 
-
+    // Slots are split (by use, not by number) into a protected region of
+    // kMaxProtectedSlots for pens, brushes, fonts and string formats,
+    // and a transient region for paths and images, each recycled least
+    // recently used first (while the table has empty slots, either
+    // region may use them).  The paths of polygons, which
+    // are mostly used once, then no longer evict the styles in regular
+    // use.  Paths and images that are used again (e.g. the glyphs of
+    // text drawn as paths) are promoted to the protected region.
     class CObjectTable {
     public:
-        CObjectTable(void) {
+        CObjectTable(void) : m_TrackRewrites(false) {
             memset(m_Table, 0, sizeof(m_Table));
+            memset(m_Stamp, 0, sizeof(m_Stamp));
+            memset(m_Protected, 0, sizeof(m_Protected));
             for (unsigned int i = 0; i < kMaxObjTableSize; ++i) {
-                m_LastUsed.push_front(i);
+                m_Transient.push_front(i);
+                m_LastUsedIter[i] = m_Transient.begin();
             }
         }
         ~CObjectTable(void) {
@@ -1016,74 +1399,168 @@ namespace EMFPLUS {
                              unsigned int lend, unsigned int ljoin,
                              unsigned int lmitre, double ps2dev,
                              bool useUserLty, EMF::ofstream &out) {
-            SPen *pen = new SPen(col, lwd, lty, lend, ljoin, lmitre, ps2dev,
-                                 useUserLty);
-            return x_InsertObject(pen, out);
+            SPen pen(col, lwd, lty, lend, ljoin, lmitre, ps2dev, useUserLty);
+            return x_InsertCopy(pen, out);
         }
         unsigned char GetBrush(SBrush* brush, EMF::ofstream &out) {
             return x_InsertObject(brush, out);
         }
         unsigned char GetBrush(unsigned int col, EMF::ofstream &out) {
-            SBrush *brush = new SBrush(col);
-            return x_InsertObject(brush, out);
+            SBrush brush(col);
+            return x_InsertCopy(brush, out);
         }
         unsigned char GetFont(unsigned char face, double size,
                               const std::string &familyUTF16,
                               EMF::ofstream &out) {
-            SFont *font = new SFont(face, size, familyUTF16);
-            return x_InsertObject(font, out);
+            SFont font(face, size, familyUTF16);
+            return x_InsertCopy(font, out);
         }
         unsigned char GetStringFormat(EStringAlign h, EStringAlign v,
                                       EMF::ofstream &out) {
-            SStringFormat *fmt = new SStringFormat(h, v);
-            return x_InsertObject(fmt, out);
+            SStringFormat fmt(h, v);
+            return x_InsertCopy(fmt, out);
         }
         unsigned char GetPath(SPath* path, EMF::ofstream &out) {
             return x_InsertObject(path, out);
         }
-        unsigned char GetImage(unsigned int *data, int w, int h,
-                              EMF::ofstream &out) {
-            SImage *image = new SImage(data, w, h);
+        // true if an object with the same contents is in the table (so
+        // getting it writes no object record)
+        bool Contains(SObject &key) const {
+            key.m_Hash = key.ContentHash();
+            return m_Index.Find(key) != NULL;
+        }
+        unsigned char GetImage(unsigned int *data, unsigned int w,
+                               unsigned int h, int pngLevel,
+                               EMF::ofstream &out) {
+            SImage *image = new SImage(data, w, h, pngLevel);
             return x_InsertObject(image, out);
         }
+        // A slot's stamp changes whenever the slot is given to another
+        // object, so callers can remember a slot & stamp and later reuse
+        // the object without building it again.
+        unsigned int GetStamp(unsigned char slot) const {
+            return m_Stamp[slot];
+        }
+        bool Reuse(unsigned char slot, unsigned int stamp) {
+            if (m_Stamp[slot] != stamp) {
+                return false;
+            }
+            ++m_Stats[m_Table[slot]->type].m_Requests;
+            x_Touch(slot);
+            return true;
+        }
+
+        const SObjectStats& GetStats(EObjectType type) const {
+            return m_Stats[type];
+        }
+        // count objects written again after eviction (this keeps the
+        // hash of every evicted object, so is meant for diagnostics)
+        void TrackRewrites(void) { m_TrackRewrites = true; }
     private:
+        typedef std::list<unsigned int> TLastUsedQueue;
+
         //note: takes ownership over pointer!
         unsigned char x_InsertObject(SObject *obj, EMF::ofstream &out) {
-            unsigned int slot;
-            TIndex::iterator i = m_Index.find(obj);
-            if (i == m_Index.end()) {
-                //use slot last used longest ago
-                slot = m_LastUsed.back();
-                m_LastUsed.pop_back();
-                SObject *old = m_Table[slot];
-                if (old) {
-                    m_Index.erase(old);
-                    delete old;
-                }
-                obj->SetObjId(slot);
-                obj->Write(out);
-                m_Table[slot] = obj;
-                i = m_Index.insert(obj).first;
-                m_LastUsed.push_front(slot);
-                m_LastUsedIter[slot] = m_LastUsed.begin();
-            } else {
+            ++m_Stats[obj->type].m_Requests;
+            obj->m_Hash = obj->ContentHash();
+            SObject *found = m_Index.Find(*obj);
+            if (found) {
                 delete obj;
-                slot = (*i)->GetObjId();
+                return x_Touch(found->GetObjId());
+            }
+            return x_Add(obj, out);
+        }
+        //key may be on the stack: it is only copied if new
+        template <class TObject>
+        unsigned char x_InsertCopy(TObject &key, EMF::ofstream &out) {
+            ++m_Stats[key.type].m_Requests;
+            key.m_Hash = key.ContentHash();
+            SObject *found = m_Index.Find(key);
+            if (found) {
+                return x_Touch(found->GetObjId());
+            }
+            return x_Add(new TObject(key), out);
+        }
+        unsigned char x_Add(SObject *obj, EMF::ofstream &out) {
+            const bool style = obj->type != eTypePath  &&
+                obj->type != eTypeImage;
+            TLastUsedQueue &from = x_FreeRegion(style);
+            unsigned int slot = from.back();
+            from.pop_back();
+            SObject *old = m_Table[slot];
+            if (old) {
+                if (m_TrackRewrites) {
+                    m_Evicted.insert(old->m_Hash);
+                }
+                m_Index.Erase(old);
+                delete old;
+            }
+            SObjectStats &stats = m_Stats[obj->type];
+            ++stats.m_Written;
+            if (m_TrackRewrites  &&  m_Evicted.erase(obj->m_Hash) > 0) {
+                ++stats.m_Rewritten;
+            }
+            obj->SetObjId(slot);
+            obj->Write(out);
+            obj->Kept();
+            m_Table[slot] = obj;
+            ++m_Stamp[slot];
+            m_Index.Insert(obj);
+            TLastUsedQueue &to = style ? m_ProtectedList : m_Transient;
+            to.push_front(slot);
+            m_LastUsedIter[slot] = to.begin();
+            m_Protected[slot] = style;
+            return slot;
+        }
+        //region to take a slot from (its slot last used longest ago):
+        //empty slots are used first; after that the protected region
+        //takes slots from the transient region until it has
+        //kMaxProtectedSlots, and gives back any it has beyond that
+        TLastUsedQueue& x_FreeRegion(bool style) {
+            if (!m_Transient.empty()  &&  !m_Table[m_Transient.back()]) {
+                return m_Transient;
+            }
+            const size_t nProtected = m_ProtectedList.size();
+            return (style ? nProtected >= kMaxProtectedSlots :
+                    nProtected > kMaxProtectedSlots) ?
+                m_ProtectedList : m_Transient;
+        }
+        unsigned char x_Touch(unsigned int slot) {
+            if (m_Protected[slot]) {
                 //update slot last used if necesary
-                if (m_LastUsedIter[slot] != m_LastUsed.begin()) {
-                    m_LastUsed.erase(m_LastUsedIter[slot]);
-                    m_LastUsed.push_front(slot);
-                    m_LastUsedIter[slot] = m_LastUsed.begin();
+                if (m_LastUsedIter[slot] != m_ProtectedList.begin()) {
+                    m_ProtectedList.erase(m_LastUsedIter[slot]);
+                    m_ProtectedList.push_front(slot);
+                    m_LastUsedIter[slot] = m_ProtectedList.begin();
                 }
+                return slot;
+            }
+            //used again: promote, demoting the protected slot last used
+            //longest ago if needed
+            m_Transient.erase(m_LastUsedIter[slot]);
+            m_ProtectedList.push_front(slot);
+            m_LastUsedIter[slot] = m_ProtectedList.begin();
+            m_Protected[slot] = true;
+            if (m_ProtectedList.size() > kMaxProtectedSlots) {
+                unsigned int demoted = m_ProtectedList.back();
+                m_ProtectedList.pop_back();
+                m_Transient.push_front(demoted);
+                m_LastUsedIter[demoted] = m_Transient.begin();
+                m_Protected[demoted] = false;
             }
             return slot;
         }
     private:
         SObject* m_Table[kMaxObjTableSize];
-        typedef std::list<unsigned int> TLastUsedQueue;
-        TLastUsedQueue m_LastUsed;
+        unsigned int m_Stamp[kMaxObjTableSize];
+        TLastUsedQueue m_Transient; //most recently used first
+        TLastUsedQueue m_ProtectedList; //most recently used first
         TLastUsedQueue::iterator m_LastUsedIter[kMaxObjTableSize];
-        typedef std::set<SObject*, ObjectPtrCmp> TIndex;
-        TIndex m_Index;
+        bool m_Protected[kMaxObjTableSize];
+        EMF::CHashIndex<SObject> m_Index;
+        SObjectStats m_Stats[eTypeStringFormat + 1];
+        bool m_TrackRewrites;
+        std::set<unsigned long long> m_Evicted; //hashes
+
     };
 } //end of EMFPLUS namespace
@@ -30,15 +30,111 @@
 
 #include <stdexcept>
 #include <string>
+#include <list>
 #include <vector>
 #include <math.h>
 
+#include "coords.h"
+#include "hash.h"
+#include "raster.h"
+#include "sink.h"
+
 namespace EMF {
-    struct ofstream : std::ofstream {
+    // Record data larger than this ("payload"; e.g., bitmaps) is
+    // produced & written in pieces of about this size.
+    const size_t kPayloadChunkSize = 1 << 24;
+
+    // Output stream with an in-memory record buffer.  Records serialize
+    // directly into "buff", which is handed to the sink (file, memory,
+    // or R connection; see sink.h) in large chunks once it exceeds
+    // "flushThreshold" bytes.
+    //
+    // An open EMF+ comment record (the EMR_COMMENT that encapsulates
+    // consecutive EMF+ records) always stays in the buffer, starting
+    // at offset "plusCommentStart", so that its size can be filled in
+    // once when the comment is closed (instead of seeking back).
+    //
+    // Record payloads (see SRecord::PayloadSize) are streamed through
+    // the buffer one piece at a time, so a large record never needs to
+    // be held in memory as a whole.
+    struct ofstream {
         bool inEMFplus;
+        bool plusCommentOpen;
+        size_t plusCommentStart;
         unsigned int nRecords;
-        std::streampos emfPlusStartPos;
-        ofstream(void) : std::ofstream() { inEMFplus = false; nRecords = 0;}
+        std::string buff;
+        size_t flushThreshold;
+        ofstream(size_t threshold = 1 << 16) : m_Sink(NULL) {
+            inEMFplus = plusCommentOpen = false;
+            plusCommentStart = 0;
+            nRecords = 0; nFlushed = 0;
+            flushThreshold = threshold;
+            buff.reserve(threshold + (threshold >> 2));
+        }
+        ~ofstream(void) { delete m_Sink; }
+
+        //note: takes ownership over pointer!
+        void open(CSink *sink) { delete m_Sink; m_Sink = sink; }
+        bool good(void) const { return m_Sink  &&  m_Sink->Ok(); }
+
+        std::streampos tellp(void) const {
+            return std::streampos(nFlushed + buff.size());
+        }
+        ofstream& flush(void) {
+            //never write out part of an open EMF+ comment
+            size_t n = plusCommentOpen ? plusCommentStart : buff.size();
+            if (n > 0) {
+                m_Sink->Write(buff.data(), n);
+                nFlushed += n;
+                if (n < buff.size()) {
+                    buff.erase(0, n);
+                    plusCommentStart = 0;
+                } else {
+                    buff.clear();
+                    x_ReleaseBuffer();
+                }
+            }
+            return *this;
+        }
+        // append n bytes of rec's payload (no EMF+ comment may be open),
+        // writing out each piece before the next is produced
+        template<class TRecord>
+        void StreamPayload(const TRecord &rec, size_t n) {
+            for (size_t done = 0;  done < n;  ) {
+                const size_t start = buff.size();
+                rec.AppendPayload(buff, done);
+                done += buff.size() - start;
+                m_Sink->Write(buff.data(), buff.size());
+                nFlushed += buff.size();
+                buff.clear(); //(keep capacity for next piece)
+            }
+            x_ReleaseBuffer();
+        }
+        void MaybeFlush(void) {
+            if (!plusCommentOpen  &&  buff.size() >= flushThreshold) {
+                flush();
+            }
+        }
+        void close(void) {
+            flush();
+            m_Sink->Close();
+        }
+        // overwrite bytes previously output at "pos" (e.g., header fields)
+        void Patch(std::streampos pos, const char *data, size_t n) {
+            flush();
+            m_Sink->Patch(pos, data, n);
+        }
+        inline void ClosePlusComment(void);
+    private:
+        void x_ReleaseBuffer(void) {
+            if (buff.empty()  &&  buff.capacity() > 4*flushThreshold) {
+                //release memory left over from a very large record
+                std::string().swap(buff);
+                buff.reserve(flushThreshold + (flushThreshold >> 2));
+            }
+        }
+        CSink *m_Sink;
+        unsigned long long nFlushed; // bytes already handed to sink
     };
 }
 
@@ -53,6 +149,7 @@ namespace EMF {
         eEMR_HEADER = 1,
         eEMR_POLYGON = 3,
         eEMR_POLYLINE = 4,
+        eEMR_POLYPOLYLINE = 7,
         eEMR_SETBRUSHORGEX = 13,
         eEMR_EOF = 14,
         eEMR_SETMAPMODE = 17,
@@ -68,6 +165,7 @@ namespace EMF {
         eEMR_SELECTOBJECT = 37,
         eEMR_CREATEPEN = 38,
         eEMR_CREATEBRUSHINDIRECT = 39,
+        eEMR_DELETEOBJECT = 40,
         eEMR_ELLIPSE = 42,
         eEMR_RECTANGLE = 43,
         eEMR_SETMITERLIMIT = 58,
@@ -79,10 +177,16 @@ namespace EMF {
         eEMR_STRETCHDIBITS = 81,
         eEMR_EXTCREATEFONTINDIRECTW = 82,
         eEMR_EXTTEXTOUTW = 84,
+        eEMR_POLYPOLYLINE16 = 90,
         eEMR_EXTCREATEPEN = 95,
         eEMR_last = 255 //placeholder for max value
     };
 
+    enum EStockObject {
+        eNULL_BRUSH = 0x80000005,
+        eNULL_PEN = 0x80000008
+    };
+
     enum EPenStyle {
         ePS_ENDCAP_ROUND  = 0x00000000,
         ePS_JOIN_ROUND    = 0x00000000,
@@ -210,6 +314,10 @@ namespace EMF {
             *this = v;
         }
         CLEType& operator= (TType v) {
+            if (sizeof(TType) == nBytes) { //resolved at compile time
+                PutLE(m_Val, v);
+                return *this;
+            }
             //store as little-endian
             unsigned char *ch = reinterpret_cast<unsigned char*>(&v);
             for (unsigned int i = 0;  i < nBytes;  ++i) {
@@ -245,6 +353,20 @@ namespace EMF {
     typedef CLEType<int, 4>   TInt4;
     typedef CLEType<float, 4> TFloat4;
 
+    // fill in the size of the open EMF+ comment record (now that all
+    // encapsulated EMF+ records are known) and release it for writing
+    void ofstream::ClosePlusComment(void) {
+        if (!plusCommentOpen) {
+            return;
+        }
+        const unsigned int size = buff.size() - plusCommentStart;
+        TUInt4 sizes[2] = {TUInt4(size), TUInt4(size - 12)};
+        buff.replace(plusCommentStart + 4, 4, sizes[0].m_Val, 4);
+        buff.replace(plusCommentStart + 8, 4, sizes[1].m_Val, 4);
+        plusCommentOpen = false;
+        MaybeFlush();
+    }
+
     // ------------------------------------------------------------------------
     // EMF Objects used repeatedly
 
@@ -311,17 +433,31 @@ namespace EMF {
         virtual std::string& Serialize(std::string &o) const {
             return o << TUInt4(iType) << nSize;
         }
+        // Bulk data to follow whatever Serialize writes, produced in
+        // pieces (of about kPayloadChunkSize bytes) by AppendPayload
+        // given how many bytes are already done.
+        virtual size_t PayloadSize(void) const { return 0; }
+        virtual void AppendPayload(std::string &, size_t) const {}
         void Write(EMF::ofstream &o) {
             if (o.inEMFplus) {
                 EMFPLUS::GetDC(o); // emf+ record to enable reading of emf
                 o.inEMFplus = false;
             }
+            o.ClosePlusComment();
             ++o.nRecords;
-            std::string buff; Serialize(buff);
-            buff.resize(((buff.size() + 3)/4)*4, '\0'); //add padding
-            std::string finalSize; finalSize << TUInt4(buff.size());
-            buff.replace(4,4, finalSize);
-            o.write(buff.data(), buff.size());
+            //serialize directly into the stream buffer & patch size in place
+            const size_t start = o.buff.size();
+            Serialize(o.buff);
+            const size_t payload = PayloadSize();
+            const size_t size = o.buff.size() - start + payload;
+            const size_t paddedSize = ((size + 3)/4)*4;
+            TUInt4 finalSize(paddedSize);
+            o.buff.replace(start+4, 4, finalSize.m_Val, 4);
+            if (payload > 0) {
+                o.StreamPayload(*this, payload);
+            }
+            o.buff.append(paddedSize - size, '\0'); //add padding
+            o.MaybeFlush();
         }
 };
 
@@ -367,7 +503,7 @@ namespace EMF {
         unsigned int  options;
         SRect  rect;
         std::string str;
-        std::vector<TUInt4> dx;
+        std::vector<unsigned int> dx;
     };
     struct S_EXTTEXTOUTW : SRecord {
         SRect   bounds;
@@ -388,9 +524,8 @@ namespace EMF {
                 strbuff.resize(((strbuff.size() + 3)/4)*4, '\0'); //add padding
                 o << TUInt4(19*4 + strbuff.length());//calculate offset for dx
                 o.append(strbuff);
-                for (unsigned int i = 0;  i < emrtext.dx.size();  ++i) {
-                    o << emrtext.dx[i];
-                }
+                AppendLE<unsigned int>(o, emrtext.dx.data(),
+                                       emrtext.dx.size());
             }
             return o;
 	}
@@ -398,11 +533,15 @@ namespace EMF {
 
     struct SObject : SRecord {
         unsigned int m_ObjId;
-        SObject(ERecordType t) : SRecord(t) {}
+        unsigned long long m_Hash; //ContentHash(), set by the object table
+        SObject(ERecordType t) : SRecord(t), m_Hash(0) {}
         virtual ~SObject(void) {}
         std::string& Serialize(std::string &o) const {
             return SRecord::Serialize(o) << TUInt4(m_ObjId);
         }
+        // equality of contents (i.e. ignoring the object id)
+        virtual unsigned long long ContentHash(void) const = 0;
+        virtual bool SameAs(const SObject &o) const = 0;
     };
 
     struct SLogPenEx {
@@ -485,6 +624,20 @@ namespace EMF {
             }
             return o;
 	}
+        unsigned long long ContentHash(void) const {
+            return CHasher().Add(iType).Add(elp).Add(styleEntries).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            if (o.iType != iType) {
+                return false;
+            }
+            const SPen &p = static_cast<const SPen&>(o);
+            return memcmp(&elp, &p.elp, sizeof(elp)) == 0  &&
+                styleEntries.size() == p.styleEntries.size()  &&
+                (styleEntries.empty()  ||
+                 memcmp(&styleEntries[0], &p.styleEntries[0],
+                        sizeof(TUInt4)*styleEntries.size()) == 0);
+        }
     };
 
     struct SLogBrushEx {
@@ -507,6 +660,13 @@ namespace EMF {
         std::string& Serialize(std::string &o) const {
             return SObject::Serialize(o) << lb.brushStyle << lb.color << lb.brushHatch;
 	}
+        unsigned long long ContentHash(void) const {
+            return CHasher().Add(iType).Add(lb).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            return o.iType == iType  &&
+                memcmp(&lb, &static_cast<const SBrush&>(o).lb, sizeof(lb)) == 0;
+        }
     };
 
     enum EFontWeight {
@@ -569,30 +729,121 @@ namespace EMF {
               << TUInt4(0);//specify no elements in design vector
             return o;
 	}
+        unsigned long long ContentHash(void) const {
+            return CHasher().Add(iType).Add(lf).Value();
+        }
+        bool SameAs(const SObject &o) const {
+            return o.iType == iType  &&
+                memcmp(&lf, &static_cast<const SFont&>(o).lf, sizeof(lf)) == 0;
+        }
     };
 
+    // bounds (left, top, right, bottom) of n points once rounded, as
+    // ToInt finds them (rounding is monotonic, so the extreme
+    // coordinates round to the extreme points)
+    inline void RoundedBounds(const double *x, const double *y, size_t n,
+                              double height, int bounds[4]) {
+        double b[4] = {x[0], y[0], x[0], y[0]};
+        for (size_t i = 1;  i < n;  ++i) {
+            b[0] = std::min(b[0], x[i]);
+            b[1] = std::min(b[1], y[i]);
+            b[2] = std::max(b[2], x[i]);
+            b[3] = std::max(b[3], y[i]);
+        }
+        if (height > 0) {
+            std::swap(b[1], b[3]);
+            b[1] = height - b[1];
+            b[3] = height - b[3];
+        }
+        for (int i = 0;  i < 4;  ++i) {
+            bounds[i] = (int) floor(b[i] + 0.5);
+        }
+    }
+
     struct SPoly : SRecord { //also == POLYLINE or POLYGON
-        SRect  bounds;
         unsigned int count;
-        SPoint *points;
-        SPoly(ERecordType iType, int n, double *x, double *y) :
-        SRecord(iType), points(new SPoint[n]) {
-            bounds.Set((int) floor(x[0] + 0.5), (int) floor(y[0] + 0.5),
-                       (int) floor(x[0] + 0.5), (int) floor(y[0] + 0.5));
-            count = n;
-            for (int i = 0;  i < n;  ++i) {
-                points[i].Set((int) floor(x[i] + 0.5), (int) floor(y[i] + 0.5));
-                if (points[i].x < bounds.left)   { bounds.left = points[i].x; }
-                if (points[i].x > bounds.right)  { bounds.right = points[i].x; }
-                if (points[i].y > bounds.bottom) { bounds.bottom = points[i].y;}
-                if (points[i].y < bounds.top)    { bounds.top = points[i].y; }
-            }
-        }
-        ~SPoly(void) { delete[] points; }
+        const double *x, *y; //not owned: must stay valid until written
+        double height; //if > 0, y is flipped to height - y when written
+        SPoly(ERecordType iType, int n, const double *xx, const double *yy,
+              double h = 0) :
+            SRecord(iType), count(n), x(xx), y(yy), height(h) {}
+        std::string& Serialize(std::string &o) const {
+            SRecord::Serialize(o);
+            if (PayloadSize() > 0) { //points streamed: need bounds first
+                int bounds[4];
+                RoundedBounds(x, y, count, height, bounds);
+                for (int i = 0;  i < 4;  ++i) {
+                    o << TInt4(bounds[i]);
+                }
+                return o << TUInt4(count);
+            }
+            const size_t boundsStart = o.size();
+            o.append(16, '\0'); //bounds filled in below
+            o << TUInt4(count);
+            const size_t start = o.size();
+            o.resize(start + 8*count);
+            int bounds[4];
+            CCoordKernels::ToInt(&o[start], x, y, count, height, bounds);
+            for (int i = 0;  i < 4;  ++i) {
+                PutLE<int>(&o[boundsStart + 4*i], bounds[i]);
+            }
+            return o;
+	}
+        size_t PayloadSize(void) const {
+            return (8*count > kPayloadChunkSize) ? 8*count : 0;
+        }
+        void AppendPayload(std::string &o, size_t done) const {
+            const size_t i = done/8;
+            const size_t n = std::min<size_t>(count - i, kPayloadChunkSize/8);
+            const size_t start = o.size();
+            o.resize(start + 8*n);
+            int bounds[4];
+            CCoordKernels::ToInt(&o[start], x + i, y + i, n, height, bounds);
+        }
+    };
+
+    // several polylines in one record: EMR_POLYPOLYLINE16 if all the
+    // (rounded) points fit in 16 bits, else EMR_POLYPOLYLINE
+    struct SPolyPolyline : SRecord {
+        unsigned int nPolys, count;
+        const int *counts;
+        const double *x, *y; //not owned: must stay valid until written
+        double height; //if > 0, y is flipped to height - y when written
+        int bounds[4];
+        SPolyPolyline(int nPoly, const int *nPts, const double *xx,
+                      const double *yy, double h = 0) :
+            SRecord(eEMR_POLYPOLYLINE16), nPolys(nPoly), count(0),
+            counts(nPts), x(xx), y(yy), height(h) {
+            for (unsigned int i = 0;  i < nPolys;  ++i) {
+                count += counts[i];
+            }
+            RoundedBounds(x, y, count, height, bounds);
+            for (int i = 0;  i < 4;  ++i) {
+                if (bounds[i] < -32768  ||  bounds[i] > 32767) {
+                    iType = eEMR_POLYPOLYLINE;
+                }
+            }
+        }
         std::string& Serialize(std::string &o) const {
-            SRecord::Serialize(o) << bounds << TUInt4(count);
-            for (unsigned int i = 0;  i < count;  ++i) {
-                o << points[i];
+            SRecord::Serialize(o);
+            for (int i = 0;  i < 4;  ++i) {
+                o << TInt4(bounds[i]);
+            }
+            o << TUInt4(nPolys) << TUInt4(count);
+            AppendLE<unsigned int>(o, counts, nPolys);
+            const size_t start = o.size();
+            if (iType == eEMR_POLYPOLYLINE) {
+                o.resize(start + 8*count);
+                int b[4];
+                CCoordKernels::ToInt(&o[start], x, y, count, height, b);
+                return o;
+            }
+            o.resize(start + 4*count);
+            char *dst = &o[start];
+            for (unsigned int i = 0;  i < count;  ++i, dst += 4) {
+                PutLE<short>(dst, (short) floor(x[i] + 0.5));
+                PutLE<short>(dst + 2, (short) floor
+                             ((height > 0 ? height - y[i] : y[i]) + 0.5));
             }
             return o;
 	}
@@ -655,6 +906,14 @@ namespace EMF {
         }
     };
 
+    struct S_DELETEOBJECT : SRecord {
+        TUInt4 ihObject;
+        S_DELETEOBJECT(void) : SRecord(eEMR_DELETEOBJECT) {}
+	std::string& Serialize(std::string &o) const {
+            return SRecord::Serialize(o) << ihObject;
+        }
+    };
+
     struct S_SETBKMODE : SRecord {
         TUInt4 mode;
         S_SETBKMODE(void) : SRecord(eEMR_SETBKMODE) {}
@@ -775,42 +1034,40 @@ namespace EMF {
         int offBmiSrc, cbBmiSrc;
         int offBitsSrc, cbBitsSrc;
         SBitmapHeader bmpHead;
-        std::string bmpData;
-        S_BITBLT(unsigned int *data, unsigned int srcW, unsigned int srcH,
+        //not owned: must stay valid until written
+        const unsigned int *bmpData;
+        const SRasterInfo *bmpInfo;
+        S_BITBLT(const unsigned int *data, const SRasterInfo &info,
                  double x, double y, double w, double h) :
             SRecord(eEMR_BITBLT) {
+            const unsigned int srcW = info.m_W, srcH = info.m_H;
             bounds.Set(x,x+w,y,y+h);
             xDest = x;
             yDest = y;
             xSrc = ySrc = 0;
             offBmiSrc = 25*4;//offset(S_BITBLT,bmp)
-            cbBmiSrc = 10*4; //size of bitmap header
+            cbBmiSrc = 10*4 + 4*info.NColors(); //bitmap header & palette
             offBitsSrc = offBmiSrc + cbBmiSrc;
-            cbBitsSrc = srcW*srcH*4;//size of bitmap
+            cbBitsSrc = info.Size();//size of bitmap
             usageSrc = 0; // DIB_RGB_COLORS
             bitBltRasterOp = 0xCC0020; //SRCCOPY
             xformSrc.Set(1,0,0,1,0,0); // identity
             bkColorSrc.Set(0,0,0); //src bg color (irrelevant for us)
             cxDest = w;
             cyDest = h;
-            bmpHead.size = cbBmiSrc;
+            bmpHead.size = 10*4;
             bmpHead.width = srcW;
             bmpHead.height = -srcH;
             bmpHead.planes = 1;
-            bmpHead.bitCount = 0x20;
+            bmpHead.bitCount = info.m_BitCount;
             bmpHead.compression = 0;//BI_RGB
             bmpHead.imageSize = 0; //ignored for BI_RGB
             bmpHead.xPelsPerMeter = 1; //arb?
             bmpHead.yPelsPerMeter = 1;
-            bmpHead.colorUsed = 0;
+            bmpHead.colorUsed = info.NColors();
             bmpHead.colorImportant = 0;
-            bmpData.resize(srcW*srcH*4);
-            for (unsigned int i = 0;  i < srcW*srcH; ++i) {
-                bmpData[4*i+0] = R_BLUE(data[i]);
-                bmpData[4*i+1] = R_GREEN(data[i]);
-                bmpData[4*i+2] = R_RED(data[i]);
-                bmpData[4*i+3] = R_ALPHA(data[i]);
-            }
+            bmpData = data;
+            bmpInfo = &info;
         }
 	std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << bounds << xDest << yDest <<
@@ -822,8 +1079,11 @@ namespace EMF {
                 bmpHead.imageSize << bmpHead.xPelsPerMeter <<
                 bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
                 bmpHead.colorImportant;
-            o.append(bmpData);
-            return o;
+            return o; //palette & pixels are the payload
+        }
+        size_t PayloadSize(void) const { return bmpInfo->DataSize(); }
+        void AppendPayload(std::string &o, size_t done) const {
+            bmpInfo->AppendData(o, bmpData, done, kPayloadChunkSize, false);
         }
     };
 
@@ -852,10 +1112,13 @@ namespace EMF {
         int offBitsSrc, cbBitsSrc;
         TInt4 cxSrc, cySrc;
         SBitmapHeader bmpHead;
-        std::string bmpData;
-        S_STRETCHBLT(unsigned int *data, unsigned int srcW, unsigned int srcH,
+        //not owned: must stay valid until written
+        const unsigned int *bmpData;
+        const SRasterInfo *bmpInfo;
+        S_STRETCHBLT(const unsigned int *data, const SRasterInfo &info,
                      double x, double y, double w, double h) :
             SRecord(eEMR_STRETCHBLT) {
+            const unsigned int srcW = info.m_W, srcH = info.m_H;
             bounds.Set(x,x+w,y,y+h);
             xDest = x;
             yDest = y;
@@ -863,33 +1126,28 @@ namespace EMF {
             cxSrc = srcW;
             cySrc = srcH;
             offBmiSrc = 27*4;//offset(S_STRETCHBLT,bmp)
-            cbBmiSrc = 10*4; //size of bitmap header
+            cbBmiSrc = 10*4 + 4*info.NColors(); //bitmap header & palette
             offBitsSrc = offBmiSrc + cbBmiSrc;
-            cbBitsSrc = srcW*srcH*4;//size of bitmap
+            cbBitsSrc = info.Size();//size of bitmap
             usageSrc = 0; // DIB_RGB_COLORS
             bitBltRasterOp = 0xCC0020; //SRCCOPY
             xformSrc.Set(1,0,0,1,0,0); // identity
             bkColorSrc.Set(0,0,0); //src bg color (irrelevant for us)
             cxDest = w;
             cyDest = h;
-            bmpHead.size = cbBmiSrc;
+            bmpHead.size = 10*4;
             bmpHead.width = srcW;
             bmpHead.height = -srcH;
             bmpHead.planes = 1;
-            bmpHead.bitCount = 0x20;
+            bmpHead.bitCount = info.m_BitCount;
             bmpHead.compression = 0;//BI_RGB
             bmpHead.imageSize = 0; //ignored for BI_RGB
             bmpHead.xPelsPerMeter = 1; //arb?
             bmpHead.yPelsPerMeter = 1;
-            bmpHead.colorUsed = 0;
+            bmpHead.colorUsed = info.NColors();
             bmpHead.colorImportant = 0;
-            bmpData.resize(srcW*srcH*4);
-            for (unsigned int i = 0;  i < srcW*srcH; ++i) {
-                bmpData[4*i+0] = R_BLUE(data[i]);
-                bmpData[4*i+1] = R_GREEN(data[i]);
-                bmpData[4*i+2] = R_RED(data[i]);
-                bmpData[4*i+3] = R_ALPHA(data[i]);
-            }
+            bmpData = data;
+            bmpInfo = &info;
         }
 	std::string& Serialize(std::string &o) const {
             SRecord::Serialize(o) << bounds << xDest << yDest <<
@@ -902,112 +1160,181 @@ namespace EMF {
                 bmpHead.imageSize << bmpHead.xPelsPerMeter <<
                 bmpHead.yPelsPerMeter << bmpHead.colorUsed <<
                 bmpHead.colorImportant;
-            o.append(bmpData);
-            return o;
+            return o; //palette & pixels are the payload
         }
-    };
-
-    struct ObjectPtrCmp {
-        bool operator() (SObject* o1, SObject* o2) const {
-            if (o1->iType < o2->iType) {
-                return true;
-            } else if (o1->iType > o2->iType) {
-                return false;
-            } else { //same type -- so compare details
-                switch (o1->iType) {
-                case eEMR_EXTCREATEPEN: {
-                    SPen *p1 = dynamic_cast<SPen*>(o1);
-                    SPen *p2 = dynamic_cast<SPen*>(o2);
-                    int res = memcmp(&p1->elp, &p2->elp, sizeof(p1->elp));
-                    if (res != 0) return res < 0;
-                    if (p1->elp.numEntries < p2->elp.numEntries) return true;
-                    if (p1->elp.numEntries > p2->elp.numEntries) return false;
-                    return p1->styleEntries < p2->styleEntries;
-                }
-                case eEMR_CREATEBRUSHINDIRECT:
-                    return memcmp(&dynamic_cast<SBrush*>(o1)->lb,
-                                  &dynamic_cast<SBrush*>(o2)->lb,
-                                  sizeof(dynamic_cast<SBrush*>(o1)->lb)) < 0;
-                case eEMR_EXTCREATEFONTINDIRECTW:
-                    return memcmp(&dynamic_cast<SFont*>(o1)->lf,
-                                  &dynamic_cast<SFont*>(o2)->lf,
-                                  sizeof(dynamic_cast<SFont*>(o1)->lf)) < 0;
-                default: {//should never happen
-                    throw std::logic_error("EMF object table scrambled");
-                }
-                }
-            }
+        size_t PayloadSize(void) const { return bmpInfo->DataSize(); }
+        void AppendPayload(std::string &o, size_t done) const {
+            bmpInfo->AppendData(o, bmpData, done, kPayloadChunkSize, false);
         }
     };
 
+    // Handles 1..kMaxHandles (0 refers to the metafile itself); when
+    // all are in use, the one used longest ago is deleted and reused.
+    // Bounding the handle table keeps playback fast.
+    const unsigned int kMaxHandles = 1024;
+
     class CObjectTable {
     public:
-        CObjectTable(void) {
+        CObjectTable(void) : m_LastUsedIter(kMaxHandles + 1),
+                             m_Stamp(kMaxHandles + 1, 0) {
             for (unsigned int i = 0;  i < eEMR_last;  ++i) {
-                m_CurrObj[i] = -1;
+                m_CurrObj[i] = 0;
             }
             m_CurrMiterLimit = -1;
         }
         ~CObjectTable(void) {
-            for (TIndex::iterator i = m_Objects.begin();
-                 i != m_Objects.end();  ++i) {
-                delete *i;
+            for (unsigned int i = 0;  i < m_Handles.size();  ++i) {
+                delete m_Handles[i];
             }
         }
-        unsigned int GetSize(void) const { return m_Objects.size(); }
+        // number of handles used (i.e. highest handle id)
+        unsigned int GetSize(void) const { return m_Handles.size(); }
 
-        unsigned char GetPen(unsigned int col, double lwd, unsigned int lty,
-                             unsigned int lend, unsigned int ljoin,
-                             unsigned int lmitre, double ps2dev,
-                             bool useUserLty, EMF::ofstream &out) {
-            SPen *pen = new SPen(col, lwd, lty, lend, ljoin, ps2dev,
-                                 useUserLty);
-            if (ljoin == GE_MITRE_JOIN  &&
-                (int) lmitre != m_CurrMiterLimit) {
-                S_SETMITERLIMIT emr;
-                emr.miterLimit = lmitre;
-                emr.Write(out);
-                m_CurrMiterLimit = lmitre;
+        unsigned int GetPen(unsigned int col, double lwd, unsigned int lty,
+                            unsigned int lend, unsigned int ljoin,
+                            unsigned int lmitre, double ps2dev,
+                            bool useUserLty, EMF::ofstream &out) {
+            if (R_TRANSPARENT(col)) {
+                x_Select(eEMR_EXTCREATEPEN, eNULL_PEN, out);
+                return eNULL_PEN;
             }
+            SPen pen(col, lwd, lty, lend, ljoin, ps2dev, useUserLty);
+            x_SetMiterLimit(ljoin, lmitre, out);
             return x_SelectObject(pen, out)->m_ObjId;
         }
-        unsigned char GetBrush(unsigned int col, EMF::ofstream &out) {
-            SBrush *brush = new SBrush(col);
+        unsigned int GetBrush(unsigned int col, EMF::ofstream &out) {
+            if (R_TRANSPARENT(col)) {
+                x_Select(eEMR_CREATEBRUSHINDIRECT, eNULL_BRUSH, out);
+                return eNULL_BRUSH;
+            }
+            SBrush brush(col);
             return x_SelectObject(brush, out)->m_ObjId;
         }
-        unsigned char GetFont(unsigned char face, int size,
-                              const std::string &familyUTF16,
-                              double rot,
-                              EMF::ofstream &out) {
-            SFont *font = new SFont(face, size, familyUTF16, rot);
+        unsigned int GetFont(unsigned char face, int size,
+                             const std::string &familyUTF16,
+                             double rot,
+                             EMF::ofstream &out) {
+            SFont font(face, size, familyUTF16, rot);
             return x_SelectObject(font, out)->m_ObjId;
         }
+        // A handle's stamp changes whenever the handle is given to
+        // another object, so callers can remember a handle & stamp and
+        // later select the object again without building it.
+        unsigned int GetStamp(unsigned int id) const {
+            return x_IsStock(id) ? 0 : m_Stamp[id];
+        }
+        bool ReusePen(unsigned int id, unsigned int stamp,
+                      unsigned int ljoin, unsigned int lmitre,
+                      EMF::ofstream &out) {
+            if (!x_Reuse(id, stamp)) {
+                return false;
+            }
+            if (!x_IsStock(id)) {
+                x_SetMiterLimit(ljoin, lmitre, out);
+            }
+            x_Select(eEMR_EXTCREATEPEN, id, out);
+            return true;
+        }
+        bool ReuseBrush(unsigned int id, unsigned int stamp,
+                        EMF::ofstream &out) {
+            if (!x_Reuse(id, stamp)) {
+                return false;
+            }
+            x_Select(eEMR_CREATEBRUSHINDIRECT, id, out);
+            return true;
+        }
     private:
-        SObject* x_GetObject(SObject *obj, EMF::ofstream &out) {
-            TIndex::iterator i = m_Objects.find(obj);
-            if (i == m_Objects.end()) {
-                i = m_Objects.insert(obj).first;
-                obj->m_ObjId = m_Objects.size();
-                obj->Write(out);
+        static bool x_IsStock(unsigned int id) { return id & 0x80000000; }
+        //key may be on the stack: it is only copied if new
+        template <class TObject>
+        SObject* x_GetObject(TObject &key, EMF::ofstream &out) {
+            key.m_Hash = key.ContentHash();
+            SObject *obj = m_Index.Find(key);
+            if (obj) {
+                x_Touch(obj->m_ObjId);
+                return obj;
+            }
+            obj = new TObject(key);
+            if (m_Handles.size() < kMaxHandles) {
+                m_Handles.push_back(NULL);
+                obj->m_ObjId = m_Handles.size();
+                m_LastUsed.push_front(obj->m_ObjId);
+                m_LastUsedIter[obj->m_ObjId] = m_LastUsed.begin();
             } else {
-                delete obj;
+                obj->m_ObjId = x_Recycle(out);
+                x_Touch(obj->m_ObjId);
+            }
+            m_Handles[obj->m_ObjId - 1] = obj;
+            ++m_Stamp[obj->m_ObjId];
+            m_Index.Insert(obj);
+            obj->Write(out);
+            return obj;
+        }
+        //delete the object used longest ago (but not one selected)
+        unsigned int x_Recycle(EMF::ofstream &out) {
+            TLastUsedQueue::iterator i = m_LastUsed.end();
+            SObject *old;
+            do {
+                old = m_Handles[*(--i) - 1];
+            } while (m_CurrObj[old->iType] == old->m_ObjId);
+            S_DELETEOBJECT emr;
+            emr.ihObject = old->m_ObjId;
+            emr.Write(out);
+            m_Index.Erase(old);
+            const unsigned int id = old->m_ObjId;
+            m_Handles[id - 1] = NULL;
+            delete old;
+            return id;
+        }
+        bool x_Reuse(unsigned int id, unsigned int stamp) {
+            if (x_IsStock(id)) {
+                return true;
+            }
+            if (m_Stamp[id] != stamp) {
+                return false;
+            }
+            x_Touch(id);
+            return true;
+        }
+        void x_Touch(unsigned int id) {
+            if (m_LastUsedIter[id] != m_LastUsed.begin()) {
+                m_LastUsed.erase(m_LastUsedIter[id]);
+                m_LastUsed.push_front(id);
+                m_LastUsedIter[id] = m_LastUsed.begin();
             }
-            return (*i);
         }
-        SObject* x_SelectObject(SObject *obj, EMF::ofstream &out) {
-            obj = x_GetObject(obj, out);
-            if (m_CurrObj[obj->iType] != (int)obj->m_ObjId) {
+        template <class TObject>
+        SObject* x_SelectObject(TObject &key, EMF::ofstream &out) {
+            SObject *obj = x_GetObject(key, out);
+            x_Select(obj->iType, obj->m_ObjId, out);
+            return obj;
+        }
+        void x_Select(ERecordType type, unsigned int id, EMF::ofstream &out) {
+            if (m_CurrObj[type] != id) {
                 S_SELECTOBJECT emr;
-                emr.ihObject = obj->m_ObjId;
+                emr.ihObject = id;
                 emr.Write(out);
-                m_CurrObj[obj->iType] = obj->m_ObjId;
+                m_CurrObj[type] = id;
+            }
+        }
+        void x_SetMiterLimit(unsigned int ljoin, unsigned int lmitre,
+                             EMF::ofstream &out) {
+            if (ljoin == GE_MITRE_JOIN  &&
+                (int) lmitre != m_CurrMiterLimit) {
+                S_SETMITERLIMIT emr;
+                emr.miterLimit = lmitre;
+                emr.Write(out);
+                m_CurrMiterLimit = lmitre;
             }
-            return obj;
         }
     private:
-        typedef std::set<SObject*, ObjectPtrCmp> TIndex;        
-        TIndex m_Objects;
-        int m_CurrObj[eEMR_last];
+        std::vector<SObject*> m_Handles; //object with handle id is [id-1]
+        CHashIndex<SObject> m_Index;
+        typedef std::list<unsigned int> TLastUsedQueue;
+        TLastUsedQueue m_LastUsed;
+        std::vector<TLastUsedQueue::iterator> m_LastUsedIter; //by id
+        std::vector<unsigned int> m_Stamp; //by id
+        unsigned int m_CurrObj[eEMR_last]; //0 = none
         int m_CurrMiterLimit;
     };
 
@@ -0,0 +1,211 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains the 64-bit content hash used to recognise
+    repeated objects (pens, brushes, fonts, paths and images) and the
+    open-addressing index that the EMF and EMF+ object tables keep
+    them in.  Each object's hash is computed once, when it is first
+    looked up; probing compares hashes and only compares the contents
+    of objects whose hashes match.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef EMF_HASH__H
+#define EMF_HASH__H
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace EMF {
+    // the xxHash64 mixing steps; bulk data is hashed over four
+    // independent lanes so it runs at memory speed
+    class CHasher {
+    public:
+        CHasher(void) : m_H(kPrime5), m_Len(0) {}
+
+        CHasher& Add(const void *data, size_t n) {
+            const unsigned char *p = static_cast<const unsigned char*>(data);
+            m_Len += n;
+            if (n >= 32) {
+                m_H = x_Round(m_H, Bytes(p, n));
+                return *this;
+            }
+            for (;  n >= 8;  p += 8, n -= 8) {
+                m_H = x_Rotl(m_H ^ x_Round(0, x_Read(p)), 27) * kPrime1 +
+                    kPrime4;
+            }
+            for (;  n > 0;  ++p, --n) {
+                m_H = x_Rotl(m_H ^ (*p * kPrime5), 11) * kPrime1;
+            }
+            return *this;
+        }
+        CHasher& Add(const std::string &s) {
+            return Add(s.data(), s.size()).Add(s.size());
+        }
+        template <typename T>
+        CHasher& Add(const std::vector<T> &v) {
+            return (v.empty() ? *this : Add(&v[0], sizeof(T)*v.size())).
+                Add(v.size());
+        }
+        // plain values only (no pointers or padding)
+        template <typename T>
+        CHasher& Add(const T &v) { return Add(&v, sizeof(T)); }
+
+        unsigned long long Value(void) const {
+            return x_Avalanche(m_H + m_Len);
+        }
+
+        // hash of n bytes in one go (different seeds give independent
+        // hashes, which can be combined for a wider key)
+        static unsigned long long Bytes(const void *data, size_t n,
+                                        unsigned long long seed = 0) {
+            const unsigned char *p = static_cast<const unsigned char*>(data);
+            unsigned long long v[4] = {seed + kPrime1 + kPrime2,
+                                       seed + kPrime2, seed, seed - kPrime1};
+            size_t i = 0;
+            for (;  i + 32 <= n;  i += 32) {
+                for (int k = 0;  k < 4;  ++k) {
+                    v[k] = x_Round(v[k], x_Read(p + i + 8*k));
+                }
+            }
+            unsigned long long h = x_Rotl(v[0], 1) + x_Rotl(v[1], 7) +
+                x_Rotl(v[2], 12) + x_Rotl(v[3], 18) + n;
+            for (;  i + 8 <= n;  i += 8) {
+                h = x_Rotl(h ^ x_Round(0, x_Read(p + i)), 27) * kPrime1 +
+                    kPrime4;
+            }
+            for (;  i < n;  ++i) {
+                h = x_Rotl(h ^ (p[i] * kPrime5), 11) * kPrime1;
+            }
+            return x_Avalanche(h);
+        }
+
+    private:
+        static const unsigned long long kPrime1 = 11400714785074694791ULL;
+        static const unsigned long long kPrime2 = 14029467366897019727ULL;
+        static const unsigned long long kPrime3 = 1609587929392839161ULL;
+        static const unsigned long long kPrime4 = 9650029242287828579ULL;
+        static const unsigned long long kPrime5 = 2870177450012600261ULL;
+        static unsigned long long x_Rotl(unsigned long long v, int r) {
+            return (v << r) | (v >> (64 - r));
+        }
+        static unsigned long long x_Round(unsigned long long acc,
+                                          unsigned long long v) {
+            return x_Rotl(acc + v*kPrime2, 31) * kPrime1;
+        }
+        static unsigned long long x_Read(const unsigned char *p) {
+            unsigned long long v;
+            memcpy(&v, p, 8); //host byte order is fine for hashing
+            return v;
+        }
+        static unsigned long long x_Avalanche(unsigned long long h) {
+            h ^= h >> 33;
+            h *= kPrime2;
+            h ^= h >> 29;
+            h *= kPrime3;
+            return h ^ (h >> 32);
+        }
+
+        unsigned long long m_H;
+        size_t m_Len;
+    };
+
+    // Set of objects (not owned) with open addressing and linear
+    // probing.  TObject needs a hash 'm_Hash' (set before the object is
+    // looked up or inserted) and 'bool SameAs(const TObject&) const'.
+    // Lookups take a key object, which may live on the stack, so that
+    // repeated objects need no allocation.
+    template <class TObject>
+    class CHashIndex {
+    public:
+        CHashIndex(void) : m_Slots(kMinSlots, (TObject*)NULL), m_Count(0) {}
+
+        size_t Size(void) const { return m_Count; }
+
+        TObject* Find(const TObject &key) const {
+            const size_t mask = m_Slots.size() - 1;
+            for (size_t i = key.m_Hash & mask;  m_Slots[i];
+                 i = (i + 1) & mask) {
+                if (m_Slots[i]->m_Hash == key.m_Hash  &&
+                    m_Slots[i]->SameAs(key)) {
+                    return m_Slots[i];
+                }
+            }
+            return NULL;
+        }
+        // obj must not already be present
+        void Insert(TObject *obj) {
+            if (2*(m_Count + 1) > m_Slots.size()) { //keep probes short
+                std::vector<TObject*> old(2*m_Slots.size(), (TObject*)NULL);
+                old.swap(m_Slots);
+                for (size_t i = 0;  i < old.size();  ++i) {
+                    if (old[i]) {
+                        x_Place(old[i]);
+                    }
+                }
+            }
+            x_Place(obj);
+            ++m_Count;
+        }
+        void Erase(const TObject *obj) {
+            const size_t mask = m_Slots.size() - 1;
+            size_t i = obj->m_Hash & mask;
+            for (;  m_Slots[i] != obj;  i = (i + 1) & mask) {
+                if (!m_Slots[i]) {
+                    return; //not present
+                }
+            }
+            //shift later members of the probe run back into the gap (so
+            //no tombstones are needed)
+            for (size_t j = (i + 1) & mask;  m_Slots[j];  j = (j + 1) & mask) {
+                const size_t home = m_Slots[j]->m_Hash & mask;
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                    m_Slots[i] = m_Slots[j];
+                    i = j;
+                }
+            }
+            m_Slots[i] = NULL;
+            --m_Count;
+        }
+
+    private:
+        enum { kMinSlots = 64 }; //power of 2
+        void x_Place(TObject *obj) {
+            const size_t mask = m_Slots.size() - 1;
+            size_t i = obj->m_Hash & mask;
+            while (m_Slots[i]) {
+                i = (i + 1) & mask;
+            }
+            m_Slots[i] = obj;
+        }
+
+        std::vector<TObject*> m_Slots;
+        size_t m_Count;
+    };
+} //end of EMF namespace
+
+#endif //EMF_HASH__H
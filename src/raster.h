@@ -0,0 +1,657 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains the encoding of R raster images (one unsigned
+    int per pixel, red in the lowest byte) into the pixel formats used
+    by EMF and EMF+ records.  Each image is first analysed to pick the
+    smallest exact encoding (8bpp palette, 24bpp or 32bpp).  Like the
+    coordinate kernels (coords.h), the 32bpp conversion uses SSE2/AVX2
+    where available and large images are split across threads (as is
+    the optional downsampling of images larger than needed).  Images
+    can also be split into tiles so that transparent areas are
+    omitted.  With
+    zlib, images can also be encoded as PNG.  (Repeated images are
+    recognised by the content hash in hash.h.)
+    --------------------------------------------------------------------------
+*/
+
+#ifndef EMF_RASTER__H
+#define EMF_RASTER__H
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "coords.h" //PutLE & SIMD availability
+#include "sink.h"   //thread availability
+
+#ifdef EMF_HAVE_THREADS
+#include <system_error>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace EMF {
+    const size_t kMinPixelsPerThread = 1 << 20;
+    const unsigned int kMaxRasterThreads = 8;
+
+    // Number of pieces in which to split work over nPixels pixels (one
+    // per thread, each with at least kMinPixelsPerThread pixels).
+    inline size_t RasterChunks(size_t nPixels) {
+#ifdef EMF_HAVE_THREADS
+        size_t nThreads = std::min<size_t>(kMaxRasterThreads,
+                                           std::thread::hardware_concurrency());
+        return std::max<size_t>(1, std::min(nThreads,
+                                            nPixels / kMinPixelsPerThread));
+#else
+        (void)nPixels;
+        return 1;
+#endif
+    }
+
+    // Calls job(begin, end) over [0, n) split into nChunks pieces, each
+    // on its own thread (or all on this thread if threads are
+    // unavailable or cannot be started).
+    template <class TJob>
+    void RunChunked(const TJob &job, size_t n, size_t nChunks) {
+#ifdef EMF_HAVE_THREADS
+        if (nChunks > 1) {
+            const size_t chunk = (n + nChunks - 1) / nChunks;
+            std::vector<std::thread> workers;
+            try {
+                for (size_t i = chunk;  i < n;  i += chunk) {
+                    workers.push_back(std::thread(std::cref(job), i,
+                                                  std::min(chunk, n - i) + i));
+                }
+                job(0, std::min(chunk, n));
+            } catch (const std::system_error&) {
+                //could not start thread: do remaining work here
+                job(0, std::min(chunk, n));
+                for (size_t i = chunk*(workers.size()+1);  i < n;
+                     i += chunk) {
+                    job(i, std::min(chunk, n - i) + i);
+                }
+            }
+            for (size_t i = 0;  i < workers.size();  ++i) {
+                workers[i].join();
+            }
+            return;
+        }
+#else
+        (void)nChunks;
+#endif
+        job(0, n);
+    }
+
+    class CPixelKernels {
+    public:
+        // n R colors -> n 32-bit BGRA pixels (the byte order of both
+        // EMF device-independent bitmaps and EMF+ 32bppARGB images)
+        static void ToBGRA(char *dst, const unsigned int *src, size_t n) {
+            static TSwizzleFn fn = x_Pick();
+            SSwizzleJob job = {fn, dst, src};
+            RunChunked(job, n, RasterChunks(n));
+        }
+
+    private:
+        typedef void (*TSwizzleFn)(char*, const unsigned int*, size_t);
+
+        struct SSwizzleJob {
+            TSwizzleFn fn;
+            char *dst;
+            const unsigned int *src;
+            void operator()(size_t begin, size_t end) const {
+                fn(dst + 4*begin, src + begin, end - begin);
+            }
+        };
+        static TSwizzleFn x_Pick(void) {
+#ifdef EMF_HAVE_AVX2
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                return x_ToBGRAAVX2;
+            }
+#endif
+#ifdef EMF_HAVE_SSE2
+            return x_ToBGRASSE2;
+#else
+            return x_ToBGRAScalar;
+#endif
+        }
+
+        static void x_ToBGRAScalar(char *dst, const unsigned int *src,
+                                   size_t n) {
+            for (size_t i = 0;  i < n;  ++i, dst += 4) {
+                const unsigned int c = src[i];
+                PutLE<unsigned int>(dst, R_BLUE(c) | R_GREEN(c) << 8 |
+                                    R_RED(c) << 16 | R_ALPHA(c) << 24);
+            }
+        }
+
+        // (with little-endian byte order, swap bytes 0 and 2 of each int)
+#ifdef EMF_HAVE_SSE2
+        static void x_ToBGRASSE2(char *dst, const unsigned int *src,
+                                 size_t n) {
+            const __m128i ga = _mm_set1_epi32(0xFF00FF00);
+            const __m128i lo = _mm_set1_epi32(0xFF);
+            size_t i = 0;
+            for (;  i + 4 <= n;  i += 4, dst += 16) {
+                __m128i c = _mm_loadu_si128
+                    (reinterpret_cast<const __m128i*>(src + i));
+                __m128i r = _mm_slli_epi32(_mm_and_si128(c, lo), 16);
+                __m128i b = _mm_and_si128(_mm_srli_epi32(c, 16), lo);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst),
+                                 _mm_or_si128(_mm_and_si128(c, ga),
+                                              _mm_or_si128(r, b)));
+            }
+            x_ToBGRAScalar(dst, src + i, n - i);
+        }
+#endif
+#ifdef EMF_HAVE_AVX2
+        __attribute__((target("avx2")))
+        static void x_ToBGRAAVX2(char *dst, const unsigned int *src,
+                                 size_t n) {
+            const __m256i shuffle = _mm256_setr_epi8
+                (2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15,
+                 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+            size_t i = 0;
+            for (;  i + 8 <= n;  i += 8, dst += 32) {
+                __m256i c = _mm256_loadu_si256
+                    (reinterpret_cast<const __m256i*>(src + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst),
+                                    _mm256_shuffle_epi8(c, shuffle));
+            }
+            x_ToBGRAScalar(dst, src + i, n - i);
+        }
+#endif
+    };
+
+    // Reduces an image to tw x th pixels (neither larger than the
+    // source).  Smooth (interpolated) images use a box filter: each
+    // output pixel averages the source area behind it, with colors
+    // weighted by alpha.  Otherwise each output pixel is the source pixel
+    // at its centre, so no new colors appear (as when R draws the image
+    // without interpolation).  Rows are split across threads.
+    class CRasterScaler {
+    public:
+        static void Downsample(std::vector<unsigned int> &dst,
+                               const unsigned int *src,
+                               unsigned int w, unsigned int h,
+                               unsigned int tw, unsigned int th,
+                               bool smooth) {
+            dst.resize((size_t)tw*th);
+            SAxis xAxis(w, tw, smooth), yAxis(h, th, smooth);
+            SScaleJob job = {&dst[0], src, w, tw, &xAxis, &yAxis, smooth};
+            RunChunked(job, th, std::min<size_t>(th, RasterChunks
+                                                 ((size_t)w*h)));
+        }
+
+    private:
+        // source indices (and weights, summing to 1) behind each output
+        // index along one axis
+        struct SAxis {
+            std::vector<unsigned int> m_First, m_Count, m_Offset;
+            std::vector<float> m_Weight;
+            SAxis(unsigned int n, unsigned int tn, bool smooth) :
+                m_First(tn), m_Count(tn, 1), m_Offset(tn) {
+                const double scale = double(n) / tn;
+                for (unsigned int o = 0;  o < tn;  ++o) {
+                    if (!smooth) {
+                        m_First[o] = std::min<unsigned int>
+                            (n - 1, (unsigned int)((o + 0.5)*scale));
+                        continue;
+                    }
+                    const double a = o*scale;
+                    const double b = std::min<double>(n, (o + 1)*scale);
+                    m_First[o] = (unsigned int)a;
+                    m_Count[o] = (unsigned int)ceil(b) - m_First[o];
+                    m_Offset[o] = m_Weight.size();
+                    for (unsigned int i = m_First[o];  i < m_First[o] +
+                             m_Count[o];  ++i) {
+                        m_Weight.push_back((std::min<double>(i + 1, b) -
+                                            std::max<double>(i, a)) / scale);
+                    }
+                }
+            }
+        };
+
+        struct SScaleJob {
+            unsigned int *dst;
+            const unsigned int *src;
+            unsigned int w, tw;
+            const SAxis *xAxis, *yAxis;
+            bool smooth;
+            void operator()(size_t begin, size_t end) const {
+                if (!smooth) {
+                    for (size_t y = begin;  y < end;  ++y) {
+                        const unsigned int *row = src +
+                            (size_t)yAxis->m_First[y]*w;
+                        for (unsigned int x = 0;  x < tw;  ++x) {
+                            dst[y*tw + x] = row[xAxis->m_First[x]];
+                        }
+                    }
+                    return;
+                }
+                //alpha-weighted r,g,b and alpha for each output column
+                std::vector<float> acc(4*tw), rowSum(4*tw);
+                for (size_t y = begin;  y < end;  ++y) {
+                    std::fill(acc.begin(), acc.end(), 0.f);
+                    const float *wy = &yAxis->m_Weight[yAxis->m_Offset[y]];
+                    for (unsigned int j = 0;  j < yAxis->m_Count[y];  ++j) {
+                        x_SumRow(&rowSum[0], src + (size_t)
+                                 (yAxis->m_First[y] + j)*w);
+                        for (size_t k = 0;  k < acc.size();  ++k) {
+                            acc[k] += wy[j]*rowSum[k];
+                        }
+                    }
+                    for (unsigned int x = 0;  x < tw;  ++x) {
+                        const float *c = &acc[4*x];
+                        const float a = c[3];
+                        dst[y*tw + x] = (a < 0.5f) ? 0 :
+                            R_RGBA(x_Channel(c[0]/a), x_Channel(c[1]/a),
+                                   x_Channel(c[2]/a), x_Channel(a));
+                    }
+                }
+            }
+            void x_SumRow(float *sum, const unsigned int *row) const {
+                for (unsigned int x = 0;  x < tw;  ++x, sum += 4) {
+                    const float *wx = &xAxis->m_Weight[xAxis->m_Offset[x]];
+                    const unsigned int *px = row + xAxis->m_First[x];
+                    float r = 0, g = 0, b = 0, a = 0;
+                    for (unsigned int i = 0;  i < xAxis->m_Count[x];  ++i) {
+                        const float wa = wx[i]*R_ALPHA(px[i]);
+                        r += wa*R_RED(px[i]);
+                        g += wa*R_GREEN(px[i]);
+                        b += wa*R_BLUE(px[i]);
+                        a += wa;
+                    }
+                    sum[0] = r;  sum[1] = g;  sum[2] = b;  sum[3] = a;
+                }
+            }
+            static unsigned int x_Channel(float v) {
+                return std::min(255, int(v + 0.5f));
+            }
+        };
+    };
+
+    // Distinct colors of an image (up to 256), kept in a small
+    // open-addressing hash table so pixels can be mapped to palette
+    // indices quickly.
+    const unsigned int kPaletteHashBits = 9;
+    class CPalette {
+    public:
+        CPalette(void) : m_Slot(1 << kPaletteHashBits, -1),
+                         m_Key(1 << kPaletteHashBits) {}
+
+        // adds col if not present and there is room; returns its index
+        // (or -1 if the palette is full)
+        int Add(unsigned int col) {
+            unsigned int h = x_Hash(col);
+            while (m_Slot[h] >= 0) {
+                if (m_Key[h] == col) {
+                    return m_Slot[h];
+                }
+                h = (h + 1) & ((1 << kPaletteHashBits) - 1);
+            }
+            if (m_Colors.size() == 256) {
+                return -1;
+            }
+            m_Key[h] = col;
+            m_Slot[h] = m_Colors.size();
+            m_Colors.push_back(col);
+            return m_Slot[h];
+        }
+        int Index(unsigned int col) const {
+            unsigned int h = x_Hash(col);
+            while (m_Slot[h] >= 0  &&  m_Key[h] != col) {
+                h = (h + 1) & ((1 << kPaletteHashBits) - 1);
+            }
+            return m_Slot[h];
+        }
+        const std::vector<unsigned int>& Colors(void) const {
+            return m_Colors;
+        }
+    private:
+        static unsigned int x_Hash(unsigned int col) {
+            return (col * 2654435761u) >> (32 - kPaletteHashBits);
+        }
+        std::vector<int> m_Slot; //index into m_Colors, -1 if empty
+        std::vector<unsigned int> m_Key;
+        std::vector<unsigned int> m_Colors;
+    };
+
+    // Pixel layout chosen for an image: 8bpp palette-indexed if it has
+    // at most 256 colors (and either is opaque or the format supports
+    // palette alpha), else 24bpp if opaque, else 32bpp.  Rows are padded
+    // to 4 bytes, as required by both EMF and EMF+.
+    struct SRasterInfo {
+        unsigned int m_W, m_H;
+        unsigned int m_BitCount;
+        bool m_Opaque;
+        CPalette m_Palette;
+
+        SRasterInfo(const unsigned int *px, unsigned int w, unsigned int h,
+                    bool paletteAlpha) : m_W(w), m_H(h) {
+            const size_t n = (size_t)w*h;
+            bool paletteOk = true;
+            unsigned int alpha = 0xFF;
+            size_t i = 0;
+            for (;  i < n  &&  paletteOk;  ++i) {
+                if (i > 0  &&  px[i] == px[i-1]) {
+                    continue; //(fast path for runs)
+                }
+                alpha &= R_ALPHA(px[i]);
+                paletteOk = (m_Palette.Add(px[i]) >= 0);
+            }
+            for (;  i < n  &&  alpha == 0xFF;  ++i) {
+                alpha &= R_ALPHA(px[i]);
+            }
+            m_Opaque = (alpha == 0xFF);
+            if (paletteOk  &&  (m_Opaque  ||  paletteAlpha)) {
+                m_BitCount = 8;
+            } else {
+                m_BitCount = m_Opaque ? 24 : 32;
+            }
+        }
+        size_t Stride(void) const { return ((m_W*m_BitCount + 31)/32)*4; }
+        size_t Size(void) const { return Stride()*m_H; }
+        unsigned int NColors(void) const {
+            return (m_BitCount == 8) ? m_Palette.Colors().size() : 0;
+        }
+
+        // bytes of palette (4-byte B,G,R,alpha entries) and pixel data
+        size_t DataSize(void) const { return 4*NColors() + Size(); }
+        // appends the next part of the palette & pixel data for px, given
+        // that "done" bytes were appended already: whole rows, totalling
+        // about maxBytes (at least one row)
+        void AppendData(std::string &o, const unsigned int *px, size_t done,
+                        size_t maxBytes, bool paletteAlpha) const {
+            const size_t paletteSize = 4*NColors();
+            if (done < paletteSize) { //(always appended whole)
+                const size_t start = o.size();
+                o.resize(start + paletteSize);
+                x_WritePalette(&o[start], paletteAlpha);
+                done = paletteSize;
+            }
+            const size_t stride = Stride();
+            const unsigned int first = (done - paletteSize) / stride;
+            const unsigned int n = std::min<size_t>
+                (m_H - first, std::max<size_t>(1, maxBytes / stride));
+            if (first < m_H) {
+                const size_t start = o.size();
+                o.resize(start + n*stride);
+                x_WriteRows(&o[start], px + (size_t)first*m_W, n);
+            }
+        }
+
+    private:
+        void x_WritePalette(char *dst, bool withAlpha) const {
+            const std::vector<unsigned int> &cols = m_Palette.Colors();
+            for (unsigned int i = 0;  i < NColors();  ++i, dst += 4) {
+                dst[0] = R_BLUE(cols[i]);
+                dst[1] = R_GREEN(cols[i]);
+                dst[2] = R_RED(cols[i]);
+                dst[3] = withAlpha ? R_ALPHA(cols[i]) : 0;
+            }
+        }
+        // writes nRows rows of pixel data, starting with the row at px
+        void x_WriteRows(char *dst, const unsigned int *px,
+                         unsigned int nRows) const {
+            if (m_BitCount == 32) { //never needs padding
+                CPixelKernels::ToBGRA(dst, px, (size_t)m_W*nRows);
+                return;
+            }
+            const size_t stride = Stride();
+            for (unsigned int y = 0;  y < nRows;  ++y, px += m_W) {
+                char *row = dst + y*stride;
+                if (m_BitCount == 24) {
+                    for (unsigned int x = 0;  x < m_W;  ++x, row += 3) {
+                        row[0] = R_BLUE(px[x]);
+                        row[1] = R_GREEN(px[x]);
+                        row[2] = R_RED(px[x]);
+                    }
+                } else {
+                    int idx = 0;
+                    for (unsigned int x = 0;  x < m_W;  ++x) {
+                        if (x == 0  ||  px[x] != px[x-1]) {
+                            idx = m_Palette.Index(px[x]);
+                        }
+                        *row++ = idx;
+                    }
+                }
+                memset(row, 0, dst + (y+1)*stride - row); //padding
+            }
+        }
+    };
+
+    // A block of image pixels: columns [m_Left, m_Right) of rows
+    // [m_Top, m_Bottom).
+    struct SPixelRect {
+        unsigned int m_Left, m_Top, m_Right, m_Bottom;
+        SPixelRect(unsigned int l, unsigned int t, unsigned int r,
+                   unsigned int b) : m_Left(l), m_Top(t), m_Right(r),
+                                     m_Bottom(b) {}
+        unsigned int Width(void) const { return m_Right - m_Left; }
+        unsigned int Height(void) const { return m_Bottom - m_Top; }
+
+        // copies these pixels of a w-pixel wide image into dst
+        void Copy(std::vector<unsigned int> &dst, const unsigned int *px,
+                  unsigned int w) const {
+            dst.resize((size_t)Width()*Height());
+            for (unsigned int y = m_Top;  y < m_Bottom;  ++y) {
+                std::copy(px + (size_t)y*w + m_Left, px + (size_t)y*w + m_Right,
+                          dst.begin() + (size_t)(y - m_Top)*Width());
+            }
+        }
+    };
+
+    // Divides an image into square tiles and returns the parts left
+    // once fully transparent tiles are dropped: each row of tiles gives
+    // one block per run of adjacent non-transparent tiles.
+    inline std::vector<SPixelRect> VisibleTiles(const unsigned int *px,
+                                                unsigned int w,
+                                                unsigned int h,
+                                                unsigned int tileSize) {
+        std::vector<SPixelRect> blocks;
+        const unsigned int nCols = (w + tileSize - 1) / tileSize;
+        std::vector<bool> visible(nCols);
+        for (unsigned int top = 0;  top < h;  top += tileSize) {
+            const unsigned int bottom = std::min(h, top + tileSize);
+            std::fill(visible.begin(), visible.end(), false);
+            for (unsigned int y = top;  y < bottom;  ++y) {
+                const unsigned int *row = px + (size_t)y*w;
+                for (unsigned int c = 0;  c < nCols;  ++c) {
+                    for (unsigned int x = c*tileSize;  !visible[c]  &&
+                             x < std::min(w, (c + 1)*tileSize);  ++x) {
+                        visible[c] = (R_ALPHA(row[x]) != 0);
+                    }
+                }
+            }
+            for (unsigned int c = 0;  c < nCols;  ++c) {
+                if (!visible[c]) {
+                    continue;
+                }
+                const unsigned int first = c;
+                while (c + 1 < nCols  &&  visible[c + 1]) {
+                    ++c;
+                }
+                blocks.push_back(SPixelRect(first*tileSize, top,
+                                            std::min(w, (c + 1)*tileSize),
+                                            bottom));
+            }
+        }
+        return blocks;
+    }
+
+#ifdef HAVE_ZLIB
+    const unsigned int kPngChunkSize = 1 << 16;
+
+    // Minimal PNG encoder (8-bit RGBA, non-interlaced, single IDAT
+    // chunk).  Each row uses whichever PNG filter gives the smallest sum
+    // of absolute differences (the heuristic suggested by the PNG spec).
+    class CPngEncoder {
+    public:
+        // appends the PNG to o and returns true, or leaves o unchanged
+        // and returns false if the PNG would exceed maxSize bytes
+        static bool Encode(std::string &o, const unsigned int *px,
+                           unsigned int w, unsigned int h, int level,
+                           size_t maxSize) {
+            const size_t start = o.size();
+            const size_t rowLen = 4*(size_t)w;
+            o.append("\x89PNG\r\n\x1a\n", 8);
+            char ihdr[13];
+            x_PutBE(ihdr, w);
+            x_PutBE(ihdr + 4, h);
+            ihdr[8] = 8;  //bit depth
+            ihdr[9] = 6;  //color type: RGBA
+            ihdr[10] = ihdr[11] = ihdr[12] = 0; //deflate, std filters, no interlace
+            x_Chunk(o, "IHDR", ihdr, 13);
+
+            const size_t idatStart = o.size();
+            o.append(8, '\0'); //length & type filled in below
+            z_stream z;
+            memset(&z, 0, sizeof(z));
+            if (deflateInit(&z, level) != Z_OK) {
+                o.resize(start);
+                return false;
+            }
+            std::string prev(rowLen, '\0'), curr(rowLen, '\0');
+            std::string filtered[5];
+            for (int f = 0;  f < 5;  ++f) {
+                filtered[f].resize(rowLen + 1);
+                filtered[f][0] = f;
+            }
+            bool ok = true;
+            for (unsigned int y = 0;  y <= h  &&  ok;  ++y) {
+                const std::string *row = NULL;
+                if (y < h) {
+                    for (unsigned int x = 0;  x < w;  ++x) { //RGBA bytes
+                        PutLE<unsigned int>(&curr[4*x], px[(size_t)y*w + x]);
+                    }
+                    row = &filtered[x_Filter(filtered, curr, prev)];
+                    curr.swap(prev);
+                }
+                z.next_in = row ? (Bytef*) row->data() : Z_NULL;
+                z.avail_in = row ? row->size() : 0;
+                const int flush = (y < h) ? Z_NO_FLUSH : Z_FINISH;
+                int ret;
+                do {
+                    const size_t pos = o.size();
+                    o.resize(pos + kPngChunkSize);
+                    z.next_out = (Bytef*) &o[pos];
+                    z.avail_out = kPngChunkSize;
+                    ret = deflate(&z, flush);
+                    o.resize(pos + kPngChunkSize - z.avail_out);
+                } while (z.avail_out == 0  ||
+                         (flush == Z_FINISH  &&  ret != Z_STREAM_END));
+                if (o.size() - start + 24 > maxSize) { //24 = IDAT+IEND ends
+                    ok = false;
+                }
+            }
+            deflateEnd(&z);
+            if (!ok) {
+                o.resize(start);
+                return false;
+            }
+            const size_t idatLen = o.size() - idatStart - 8;
+            x_PutBE(&o[idatStart], idatLen);
+            memcpy(&o[idatStart + 4], "IDAT", 4);
+            char crc[4];
+            x_PutBE(crc, crc32(crc32(0L, Z_NULL, 0),
+                               (const Bytef*) &o[idatStart + 4],
+                               idatLen + 4));
+            o.append(crc, 4);
+            x_Chunk(o, "IEND", NULL, 0);
+            return true;
+        }
+
+    private:
+        static void x_PutBE(char *dst, unsigned long v) {
+            dst[0] = (v >> 24) & 0xFF;
+            dst[1] = (v >> 16) & 0xFF;
+            dst[2] = (v >> 8) & 0xFF;
+            dst[3] = v & 0xFF;
+        }
+        static void x_Chunk(std::string &o, const char *type,
+                            const char *data, unsigned int n) {
+            char buf[4];
+            x_PutBE(buf, n);
+            o.append(buf, 4);
+            const size_t start = o.size();
+            o.append(type, 4);
+            o.append(data, n);
+            x_PutBE(buf, crc32(crc32(0L, Z_NULL, 0),
+                               (const Bytef*) &o[start], n + 4));
+            o.append(buf, 4);
+        }
+        static int x_Paeth(int a, int b, int c) {
+            const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2*c);
+            return (pa <= pb  &&  pa <= pc) ? a : (pb <= pc) ? b : c;
+        }
+        // fills all 5 filtered versions of row; returns the index of
+        // the one to use
+        static int x_Filter(std::string *filtered, const std::string &row,
+                            const std::string &prev) {
+            const unsigned char *r = (const unsigned char*) row.data();
+            const unsigned char *u = (const unsigned char*) prev.data();
+            unsigned char *f[5];
+            for (int k = 0;  k < 5;  ++k) {
+                f[k] = (unsigned char*) &filtered[k][1];
+            }
+            const size_t n = row.size();
+            memcpy(f[0], r, n);
+            unsigned long sums[5] = {0, 0, 0, 0, 0};
+            for (size_t i = 0;  i < n  &&  i < 4;  ++i) { //no left neighbor
+                f[1][i] = r[i];
+                f[2][i] = r[i] - u[i];
+                f[3][i] = r[i] - (u[i] >> 1);
+                f[4][i] = r[i] - u[i];
+            }
+            for (size_t i = 4;  i < n;  ++i) {
+                const int a = r[i-4], b = u[i], c = u[i-4];
+                f[1][i] = r[i] - a;
+                f[2][i] = r[i] - b;
+                f[3][i] = r[i] - ((a + b) >> 1);
+                f[4][i] = r[i] - x_Paeth(a, b, c);
+            }
+            for (int k = 0;  k < 5;  ++k) {
+                for (size_t i = 0;  i < n;  ++i) {
+                    sums[k] += abs((signed char) f[k][i]);
+                }
+            }
+            int best = 0;
+            for (int k = 1;  k < 5;  ++k) {
+                if (sums[k] < sums[best]) {
+                    best = k;
+                }
+            }
+            return best;
+        }
+    };
+#endif
+} //end of EMF namespace
+
+#endif
@@ -0,0 +1,474 @@
+/* $Id$
+    --------------------------------------------------------------------------
+    Add-on package to R to produce EMF graphics output (for import as
+    a high-quality vector graphic into Microsoft Office or OpenOffice).
+
+
+    Copyright (C) 2011 Philip Johnson
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+    Note this header file is C++ (R policy requires that all headers
+    end with .h).
+
+    This header contains the destinations ("sinks") to which finished
+    EMF output is handed by EMF::ofstream: a file, memory (returned to
+    R as a raw vector), or an R connection.  Sinks can be wrapped to
+    gzip-compress the output (.emz files) and, if they do not call R
+    while writing, so that writing happens on a background thread.
+    --------------------------------------------------------------------------
+*/
+
+#ifndef EMF_SINK__H
+#define EMF_SINK__H
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if __cplusplus >= 201103L
+#define EMF_HAVE_THREADS
+#include <atomic>
+#include <chrono>
+#include <thread>
+#endif
+
+namespace EMF {
+    class CSink {
+    public:
+        virtual ~CSink(void) {}
+        virtual bool Ok(void) const { return true; }
+        // true if Write/Patch use the R API (and so must stay on the R
+        // thread)
+        virtual bool CallsR(void) const { return false; }
+        // append bytes to the end of the output
+        virtual void Write(const char *data, size_t n) = 0;
+        // overwrite bytes previously written at offset "pos"
+        virtual void Patch(unsigned long long pos,
+                           const char *data, size_t n) = 0;
+        virtual void Close(void) {}
+    };
+
+    class CFileSink : public CSink {
+    public:
+        CFileSink(const char *filename) {
+            m_File.open(filename, std::ios_base::binary);
+        }
+        bool Ok(void) const { return m_File.good(); }
+        void Write(const char *data, size_t n) {
+            m_File.write(data, n);
+        }
+        void Patch(unsigned long long pos, const char *data, size_t n) {
+            std::streampos end = m_File.tellp();
+            m_File.seekp(pos);
+            m_File.write(data, n);
+            m_File.seekp(end);
+        }
+        void Close(void) { m_File.close(); }
+    private:
+        std::ofstream m_File;
+    };
+
+    // keeps entire file in memory; on closing, stores it as raw vector
+    // "emf" in the supplied R environment
+    class CMemorySink : public CSink {
+    public:
+        CMemorySink(SEXP env) : m_Env(env) {
+            R_PreserveObject(m_Env);
+        }
+        ~CMemorySink(void) { R_ReleaseObject(m_Env); }
+        void Write(const char *data, size_t n) {
+            m_Data.append(data, n);
+        }
+        void Patch(unsigned long long pos, const char *data, size_t n) {
+            m_Data.replace(pos, n, data, n);
+        }
+        void Close(void) {
+            SEXP raw;
+            PROTECT(raw = Rf_allocVector(RAWSXP, m_Data.size()));
+            memcpy(RAW(raw), m_Data.data(), m_Data.size());
+            Rf_defineVar(Rf_install("emf"), raw, m_Env);
+            UNPROTECT(1);
+            std::string().swap(m_Data);
+        }
+    private:
+        SEXP m_Env;
+        std::string m_Data;
+    };
+
+    // streams output to an R connection (using R-level writeBin/seek,
+    // so any connection class that can seek works).  The connection is
+    // opened if necessary (and then also closed when finished).
+    // Patching the header when finished requires seeking, so
+    // connections that cannot seek backwards (pipes, sockets, gzcon,
+    // compressed files, etc.) are not Seekable() and are refused by
+    // the device.  R errors while writing are caught (so they do not
+    // unwind through C++ frames) and make the sink no longer Ok().
+    const size_t kConnChunkSize = 1 << 20; //max bytes per writeBin call
+    class CConnectionSink : public CSink {
+    public:
+        CConnectionSink(SEXP con) : m_Con(con), m_Opened(false),
+                                    m_Seekable(false), m_Failed(false),
+                                    m_Start(0), m_Pos(0) {
+            R_PreserveObject(m_Con);
+            SEXP isOpen = x_Call("isOpen");
+            if (m_Failed) {
+                return;
+            }
+            if (!Rf_asLogical(isOpen)) {
+                SEXP mode, call;
+                PROTECT(mode = Rf_mkString("wb"));
+                PROTECT(call = Rf_lang3(Rf_install("open"), m_Con, mode));
+                x_Eval(call);
+                UNPROTECT(2);
+                m_Opened = !m_Failed;
+            }
+            if (!m_Failed  &&  Rf_inherits(m_Con, "file")) {
+                SEXP seekable = x_Call("isSeekable");
+                m_Seekable = !m_Failed  &&  Rf_asLogical(seekable) == TRUE;
+            }
+            if (m_Seekable) {
+                m_Start = x_Seek(NA_REAL); //just query current position
+            }
+        }
+        ~CConnectionSink(void) {
+            if (m_Opened) { //(not closed yet, e.g. if the device failed)
+                x_Call("close");
+            }
+            R_ReleaseObject(m_Con);
+        }
+        bool Ok(void) const { return !m_Failed; }
+        bool Seekable(void) const { return m_Seekable; }
+        bool CallsR(void) const { return true; }
+        void Write(const char *data, size_t n) {
+            for (size_t i = 0;  i < n  &&  !m_Failed;  i += kConnChunkSize) {
+                x_WriteBin(data + i, std::min(kConnChunkSize, n - i));
+            }
+            m_Pos += n;
+        }
+        void Patch(unsigned long long pos, const char *data, size_t n) {
+            x_Seek(m_Start + pos);
+            x_WriteBin(data, n);
+            x_Seek(m_Start + m_Pos);
+        }
+        void Close(void) {
+            x_Call(m_Opened ? "close" : "flush");
+            m_Opened = false;
+        }
+    private:
+        //evaluates call, recording (rather than raising) any R error
+        SEXP x_Eval(SEXP call) {
+            if (m_Failed) {
+                return R_NilValue;
+            }
+            int err = 0;
+            SEXP res = R_tryEval(call, R_BaseEnv, &err);
+            if (err) {
+                m_Failed = true;
+                return R_NilValue;
+            }
+            return res;
+        }
+        SEXP x_Call(const char *fn) {
+            SEXP call, res;
+            PROTECT(call = Rf_lang2(Rf_install(fn), m_Con));
+            res = x_Eval(call);
+            UNPROTECT(1);
+            return res;
+        }
+        void x_WriteBin(const char *data, size_t n) {
+            SEXP raw, call;
+            PROTECT(raw = Rf_allocVector(RAWSXP, n));
+            memcpy(RAW(raw), data, n);
+            PROTECT(call = Rf_lang3(Rf_install("writeBin"), raw, m_Con));
+            x_Eval(call);
+            UNPROTECT(2);
+        }
+        //returns position prior to seeking
+        double x_Seek(double pos) {
+            SEXP where, origin, rw, call;
+            PROTECT(where = Rf_ScalarReal(pos));
+            PROTECT(origin = Rf_mkString("start"));
+            PROTECT(rw = Rf_mkString("write"));
+            PROTECT(call = Rf_lang5(Rf_install("seek"), m_Con,
+                                    where, origin, rw));
+            double prev = Rf_asReal(x_Eval(call));
+            UNPROTECT(4);
+            return prev;
+        }
+
+        SEXP m_Con;
+        bool m_Opened; //true if opened (and not yet closed) by us
+        bool m_Seekable;
+        bool m_Failed; //an R call raised an error
+        double m_Start; //position of connection when we started
+        unsigned long long m_Pos;
+    };
+
+#ifdef HAVE_ZLIB
+    // Wraps another sink, gzip-compressing output on the fly (for .emz
+    // files).  The EMF header record (size given in its bytes 4-7) is
+    // kept in memory and written uncompressed as a deflate "stored"
+    // block at the start of the stream, so that its fields can still be
+    // patched in place when closing.  The gzip CRC of the final data is
+    // then completed using crc32_combine.  Output that cannot be
+    // encoded this way makes the sink no longer Ok() (rather than
+    // throwing, as the sink is called from R's device callbacks).
+    const size_t kGzipChunkSize = 1 << 16;
+    class CGzipSink : public CSink {
+    public:
+        //note: takes ownership over pointer!
+        CGzipSink(CSink *sink, int level = Z_DEFAULT_COMPRESSION) :
+            m_Sink(sink), m_HeadWritten(false), m_Failed(false),
+            m_BodyLen(0) {
+            memset(&m_Z, 0, sizeof(m_Z));
+            m_ZOk = (deflateInit2(&m_Z, level, Z_DEFLATED, -15 /*raw*/, 8,
+                                  Z_DEFAULT_STRATEGY) == Z_OK);
+            m_BodyCRC = crc32(0L, Z_NULL, 0);
+            m_Out.resize(kGzipChunkSize);
+            //gzip member header: magic, deflate, no flags/mtime, unknown OS
+            const char gzHead[10] = {'\x1f','\x8b', 8, 0, 0,0,0,0, 0,'\xff'};
+            m_Sink->Write(gzHead, 10);
+        }
+        ~CGzipSink(void) {
+            deflateEnd(&m_Z);
+            delete m_Sink;
+        }
+        bool Ok(void) const {
+            return m_ZOk  &&  !m_Failed  &&  m_Sink->Ok();
+        }
+        bool CallsR(void) const { return m_Sink->CallsR(); }
+        void Write(const char *data, size_t n) {
+            while (!m_HeadWritten  &&  n > 0) {
+                size_t want = m_Head.size() < 8 ? 8 : x_HeadSize();
+                size_t len = std::min(n, want - m_Head.size());
+                m_Head.append(data, len);
+                data += len;
+                n -= len;
+                if (m_Head.size() >= 8  &&  m_Head.size() == x_HeadSize()) {
+                    x_WriteHead();
+                }
+            }
+            x_Deflate(data, n, Z_NO_FLUSH);
+        }
+        void Patch(unsigned long long pos, const char *data, size_t n) {
+            if (!m_HeadWritten  ||  pos + n > m_Head.size()) {
+                m_Failed = true; //can only patch EMF header of EMZ
+                return;
+            }
+            m_Head.replace(pos, n, data, n);
+            m_Sink->Patch(10 + 5 + pos, data, n);//after gzip & block headers
+        }
+        void Close(void) {
+            if (!m_HeadWritten) {
+                x_WriteHead();
+            }
+            x_Deflate(NULL, 0, Z_FINISH);
+            uLong crc = crc32(0L, (const Bytef*) m_Head.data(), m_Head.size());
+            crc = x_CombineCRC(crc, m_BodyCRC, m_BodyLen);
+            unsigned long size = m_Head.size() + m_BodyLen;
+            char trailer[8];
+            for (int i = 0;  i < 4;  ++i) {
+                trailer[i] = (crc >> (8*i)) & 0xFF;
+                trailer[4+i] = (size >> (8*i)) & 0xFF;
+            }
+            m_Sink->Write(trailer, 8);
+            m_Sink->Close();
+        }
+    private:
+        size_t x_HeadSize(void) const {
+            const unsigned char *p = (const unsigned char*) m_Head.data();
+            return p[4] | p[5] << 8 | p[6] << 16 | (size_t) p[7] << 24;
+        }
+        //crc32_combine takes a z_off_t length, which may be 32 bits (e.g.,
+        //on Windows); without crc32_combine64, the first CRC is shifted
+        //past the body in pieces (combining with a zero CRC only shifts)
+        static uLong x_CombineCRC(uLong crc1, uLong crc2,
+                                  unsigned long long len2) {
+#if defined(Z_LARGE64)  ||  defined(Z_WANT64)
+            return crc32_combine64(crc1, crc2, len2);
+#else
+            const unsigned long long kPiece = 1 << 30;
+            for (;  len2 > kPiece;  len2 -= kPiece) {
+                crc1 = crc32_combine(crc1, 0, kPiece);
+            }
+            return crc32_combine(crc1, crc2, len2);
+#endif
+        }
+        void x_WriteHead(void) {
+            const size_t len = m_Head.size();
+            m_HeadWritten = true;
+            if (len > 0xFFFF) {
+                m_Failed = true; //EMF header too large for a stored block
+                return;
+            }
+            //non-final stored block: BFINAL=0/BTYPE=00, then LEN & ~LEN
+            const char block[5] = {0, (char)(len & 0xFF), (char)(len >> 8),
+                                   (char)(~len & 0xFF),
+                                   (char)((~len >> 8) & 0xFF)};
+            m_Sink->Write(block, 5);
+            m_Sink->Write(m_Head.data(), len);
+        }
+        void x_Deflate(const char *data, size_t n, int flush) {
+            if (n > 0) { //(crc32 of Z_NULL returns the initial value)
+                m_BodyCRC = crc32(m_BodyCRC, (const Bytef*) data, n);
+                m_BodyLen += n;
+            }
+            m_Z.next_in = (Bytef*) data;
+            m_Z.avail_in = n;
+            do {
+                m_Z.next_out = (Bytef*) &m_Out[0];
+                m_Z.avail_out = m_Out.size();
+                deflate(&m_Z, flush);
+                m_Sink->Write(m_Out.data(), m_Out.size() - m_Z.avail_out);
+            } while (m_Z.avail_out == 0);
+        }
+
+        CSink *m_Sink;
+        z_stream m_Z;
+        bool m_ZOk;
+        bool m_HeadWritten;
+        bool m_Failed; //output could not be encoded as EMZ
+        std::string m_Head; //uncompressed EMF header record
+        std::string m_Out;  //compressed output chunk
+        uLong m_BodyCRC;
+        unsigned long long m_BodyLen;
+    };
+#endif
+
+#ifdef EMF_HAVE_THREADS
+    // Wraps another sink so that its writes happen on a background
+    // thread.  The R thread copies output into fixed-size slots of a
+    // ring buffer (a lock-free single-producer/single-consumer queue)
+    // and only waits if the writer falls more than kAsyncSlots behind.
+    // Patch and Close wait for the writer to catch up and then run on
+    // the R thread, so the wrapped sink may call R when closing.  A
+    // failed write (an exception, or the wrapped sink no longer Ok())
+    // is recorded for Ok() to report on the R thread, and later output
+    // is dropped.
+    const size_t kAsyncSlots = 8;
+    const size_t kAsyncSlotSize = 1 << 16;
+    class CAsyncSink : public CSink {
+    public:
+        //note: takes ownership over pointer!
+        CAsyncSink(CSink *sink) : m_Sink(sink), m_Head(0), m_Tail(0),
+                                  m_Done(false), m_Failed(false) {
+            for (size_t i = 0;  i < kAsyncSlots;  ++i) {
+                m_Slots[i].reserve(kAsyncSlotSize);
+            }
+            m_Thread = std::thread(&CAsyncSink::x_Run, this);
+        }
+        ~CAsyncSink(void) {
+            x_Stop();
+            delete m_Sink;
+        }
+        bool Ok(void) const {
+            //(the wrapped sink is only asked directly once the writer
+            //thread is finished with it)
+            return !m_Failed.load(std::memory_order_acquire)  &&
+                (m_Thread.joinable()  ||  m_Sink->Ok());
+        }
+        void Write(const char *data, size_t n) {
+            while (n > 0) {
+                size_t head = m_Head.load(std::memory_order_relaxed);
+                for (unsigned int i = 0;
+                     head - m_Tail.load(std::memory_order_acquire) ==
+                         kAsyncSlots;  ++i) {
+                    x_Backoff(i); //queue full
+                }
+                size_t len = std::min(n, kAsyncSlotSize);
+                m_Slots[head % kAsyncSlots].assign(data, len);
+                m_Head.store(head + 1, std::memory_order_release);
+                data += len;
+                n -= len;
+            }
+        }
+        void Patch(unsigned long long pos, const char *data, size_t n) {
+            x_Drain();
+            if (!m_Failed.load(std::memory_order_acquire)) {
+                m_Sink->Patch(pos, data, n);
+            }
+        }
+        void Close(void) {
+            x_Stop();
+            m_Sink->Close();
+        }
+    private:
+        static void x_Backoff(unsigned int nTries) {
+            if (nTries < 16) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds
+                                            (nTries < 64 ? 50 : 1000));
+            }
+        }
+        void x_Drain(void) {
+            for (unsigned int i = 0;
+                 m_Tail.load(std::memory_order_acquire) !=
+                     m_Head.load(std::memory_order_relaxed);  ++i) {
+                x_Backoff(i);
+            }
+        }
+        void x_Stop(void) {
+            if (m_Thread.joinable()) {
+                m_Done.store(true, std::memory_order_release);
+                m_Thread.join();
+            }
+        }
+        void x_Run(void) { // writer thread
+            unsigned int nIdle = 0;
+            for (;;) {
+                size_t tail = m_Tail.load(std::memory_order_relaxed);
+                if (tail == m_Head.load(std::memory_order_acquire)) {
+                    if (m_Done.load(std::memory_order_acquire)  &&
+                        tail == m_Head.load(std::memory_order_acquire)) {
+                        return;
+                    }
+                    x_Backoff(nIdle++);
+                    continue;
+                }
+                nIdle = 0;
+                if (!m_Failed.load(std::memory_order_relaxed)) {
+                    const std::string &slot = m_Slots[tail % kAsyncSlots];
+                    try {
+                        m_Sink->Write(slot.data(), slot.size());
+                        if (!m_Sink->Ok()) {
+                            m_Failed.store(true, std::memory_order_release);
+                        }
+                    } catch (...) { //(must not escape the thread)
+                        m_Failed.store(true, std::memory_order_release);
+                    }
+                }
+                m_Tail.store(tail + 1, std::memory_order_release);
+            }
+        }
+
+        CSink *m_Sink;
+        std::string m_Slots[kAsyncSlots];
+        std::atomic<size_t> m_Head; //next slot to fill (R thread)
+        std::atomic<size_t> m_Tail; //next slot to write (writer thread)
+        std::atomic<bool> m_Done;
+        std::atomic<bool> m_Failed; //a write failed on the writer thread
+        std::thread m_Thread;
+    };
+#endif
+} //end of EMF namespace
+
+#endif //EMF_SINK__H